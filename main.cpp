@@ -1,543 +1,5306 @@
 #include <iostream>
 #include <sstream>
+#include <fstream>
 #include <vector>
 #include <unordered_map>
-#include <set>
 #include <cmath>
 #include <algorithm>
 #include <cassert>
-#include <random>
 #include <format>
-#include <queue>
-#include <tuple>
+#include <array>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <barrier>
+#include <mutex>
+#include <condition_variable>
+#include <cstdio>
+#include <type_traits>
+#include <deque>
+#include <stdexcept>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <string>
+#include <chrono>
+#include <numeric>
+#include <optional>
 #include <limits>
+#include <cstdint>
+#include <string_view>
+#include <bit>
 
 using namespace std;
 
-// Implement simulated annealing algorithm to optimize schedule.
-class ScheduleAnnealer {
+// Teams are interned into dense ids when a schedule is parsed so that the annealer only ever handles integers.
+using TeamId = uint16_t;
+
+// A schedule stored as two contiguous arrays of team ids (one for each side of every game). The names of the 
+// teams are only needed again when the schedule is printed.
+struct Schedule {
+    vector<string> team_names;
+    vector<TeamId> teams[2];
+
+    int size() const { return teams[0].size(); }
+    int num_teams() const { return team_names.size(); }
+    const string& team_name(TeamId team) const { return team_names[team]; }
+
+    // Return the id of the given team, assigning it the next free id if it hasn't been seen yet.
+    TeamId intern_team(string_view name) {
+        auto it = team_ids.find(name);
+        if (it != team_ids.end()) {
+            return it->second;
+        }
+        if (team_names.size() > numeric_limits<TeamId>::max()) {
+            throw runtime_error("Too many teams (at most " + to_string(numeric_limits<TeamId>::max() + 1) + ")");
+        }
+        TeamId team = team_names.size();
+        team_names.emplace_back(name);
+        team_ids.emplace(team_names.back(), team);
+        return team;
+    }
+
+    // Return the id of the given team, or nullopt if it doesn't play in the schedule.
+    optional<TeamId> find_team(string_view name) const {
+        auto it = team_ids.find(name);
+        if (it == team_ids.end()) {
+            return nullopt;
+        }
+        return it->second;
+    }
+
+    void add_game(TeamId team1, TeamId team2) {
+        teams[0].push_back(team1);
+        teams[1].push_back(team2);
+    }
+
+    void swap_games(int idx1, int idx2) {
+        swap(teams[0][idx1], teams[0][idx2]);
+        swap(teams[1][idx1], teams[1][idx2]);
+    }
+
+private:
+    // Hashes and compares names as string_views, so that names being parsed can be looked up without copying them.
+    struct NameHash {
+        using is_transparent = void;
+        size_t operator()(string_view name) const { return hash<string_view>()(name); }
+    };
+    unordered_map<string, TeamId, NameHash, equal_to<>> team_ids;
+};
+
+// Appends values to a byte buffer (used for checkpoints). Values are stored in the machine's native layout, so 
+// buffers are only meant to be read back on the same kind of machine.
+class BinaryWriter {
 public:
-    ScheduleAnnealer(vector<vector<string>>& schedule, int num_teams) 
-        : schedule(schedule), num_teams(num_teams), schedule_length(schedule.size()), distribution(0.0, 1.0) {
-        setup_annealer();
-        srand(1); // TODO - change seed to be random unless specified
+    template <typename T>
+    void write(const T& value) {
+        static_assert(is_trivially_copyable_v<T>);
+        data.append((const char*) &value, sizeof(T));
     }
 
-    void anneal() {
-        cout << "Initial Cost: " << calculate_schedule_cost() << endl;
-        cout << "Initial Gap Distribution: " << calculate_gap_dist() << " (min/25/50/75/max)" << endl;
-        
-        int iters_per_print = iters_per_temp / 10;
-        float cum_cost = calculate_schedule_cost();
-        
-        for (float temperature = initial_temperature; temperature > min_temperature; temperature *= cooling_rate) {
-            int num_accepted = 0;
-            for (int iter = 0; iter < iters_per_temp; iter++) {
-                vector<int> candidate_swap = choose_swap();
-                int idx1 = candidate_swap[0];
-                int idx2 = candidate_swap[1];
-                float swap_cost_change = calculate_cost_change(idx1, idx2);
-                if (distribution(generator) < exp(-swap_cost_change / temperature)) {
-                    num_accepted++;
-                    cum_cost += swap_cost_change;
-                    // Update the team_to_games map.
-                    for (int i = 0; i < 2; i++) {
-                        string team1 = schedule[idx1][i];
-                        string team2 = schedule[idx2][i];
-                        
-                        if (team1 != schedule[idx2][0] && team1 != schedule[idx2][1]) {
-                            team_to_games[team1].erase(idx1);
-                            team_to_games[team1].insert(idx2);
-                        }
-                        if (team2 != schedule[idx1][0] && team2 != schedule[idx1][1]) {
-                            team_to_games[team2].erase(idx2);
-                            team_to_games[team2].insert(idx1);
-                        }
-                    }
-                    swap(schedule[idx1], schedule[idx2]);
-                }
+    template <typename T>
+    void write_vector(const vector<T>& values) {
+        static_assert(is_trivially_copyable_v<T>);
+        write<uint64_t>(values.size());
+        data.append((const char*) values.data(), values.size() * sizeof(T));
+    }
 
-                // Print the annealing progress after iters_per_print iterations.
-                if (iter % iters_per_print == 0 && iter != 0) {
-                    cout << "Iteration " << iter << " for temperature " << temperature << ": Acceptance Rate = " 
-                        << (float) num_accepted / iters_per_print << endl;
-                    num_accepted = 0;
-                }
-                
-                // Refresh the set of worst games after (refresh_freq * num_worst_games^2) iterations.
-                if (iter % (int) (refresh_freq * pow(num_worst_games, 2)) == 0 && iter != 0) {
-                    refresh_worst_games();
-                }
-            }
-        }
-        
-        cout << "Final Cost: " << calculate_schedule_cost() << endl;
-        cout << "Final Gap Distribution: " << calculate_gap_dist() << " (min/25/50/75/max)" << endl;
+    void write_string(const string& value) {
+        write<uint64_t>(value.size());
+        data.append(value);
     }
 
+    string& buffer() { return data; }
+
 private:
-    /*=========================
-        Schedule Data
-      =========================*/
-    vector<vector<string>>& schedule;
-    int num_teams;
-    int schedule_length;
+    string data;
+};
 
-    /*=========================
-        Annealing Parameters
-      =========================*/
-    // Control how much to punish large deviations from the target number of games played. Specifically, the 
-    // deviation from the target number of games played is raised to the deviation_exponent power. e.g. for 
-    // deviation_exponent = 2.0, the cost of a given schedule is the total squared deviation from the target
-    // games played.
-    float deviation_exponent = 3.0;
-    // Initial temperature for the simulated annealing algorithm.
-    float initial_temperature = 1000.0;
-    // Number of iterations per temperature.
-    int iters_per_temp = 500000;
-    // Cooling rate for the simulated annealing algorithm.
-    float cooling_rate = 0.3;
-    // Temperature at which the annealing process stops.
-    float min_temperature = 10.0;
-    // The number of games to include in the set of all possible swaps (by choosing the n games that have 
-    // the highest benefit when removed).
-    int num_worst_games = 128;
-    // The refresh rate for the set of n worst games (the set of n worst games is refreshed after k * n^2 
-    // iterations of the annealer). So, a lower value of refresh_freq will keep n_worst_games more fresh at 
-    // the cost of extra computation time.
-    float refresh_freq = 0.01;
+// Reads back values written by BinaryWriter, throwing if the buffer is too short.
+class BinaryReader {
+public:
+    explicit BinaryReader(string_view data) : data(data) {}
 
-    /*=========================
-        Pre-Processing Data
-      =========================*/
-    // Track the indices of games for each team.
-    unordered_map<string, set<int>> team_to_games;
-    // Track the cost of removing the game at the given index (negative change means removing the 
-    // game is beneficial).
-    vector<float> cost_of_removing_game;
-    // Track the indices of the games which have the best change in cost when they are removed. This 
-    // set of indices will be refreshed after (refresh_freq * num_worst_games^2) iterations.
-    vector<int> worst_games;
+    template <typename T>
+    T read() {
+        static_assert(is_trivially_copyable_v<T>);
+        T value;
+        memcpy(&value, take(sizeof(T)), sizeof(T));
+        return value;
+    }
 
-    /*=========================
-        Helper Functions
-      =========================*/
-    // Generator for random numbers.
-    default_random_engine generator;
-    uniform_real_distribution<double> distribution;
-    
-    // Pre-process schedule to improve efficiency of annealing algorithm.
-    void setup_annealer() {
-        for (int i = 0; i < schedule_length; i++) {
-            // For every game in the schedule, determine the two teams in that game.
-            string team1 = schedule[i][0];
-            string team2 = schedule[i][1];
-            // Add this game to the vector of games that each team has played.
-            if (team_to_games.find(team1) == team_to_games.end()) {
-                set<int> games = {i};
-                team_to_games[team1] = games;
-            } else {
-                team_to_games[team1].insert(i);
-            }
-            if (team_to_games.find(team2) == team_to_games.end()) {
-                set<int> games = {i};
-                team_to_games[team2] = games;
-            } else {
-                team_to_games[team2].insert(i);
+    template <typename T>
+    vector<T> read_vector() {
+        uint64_t size = read<uint64_t>();
+        if (size > data.size() / sizeof(T)) {
+            throw runtime_error("Truncated data");
+        }
+        vector<T> values(size);
+        const char* bytes = take(size * sizeof(T));
+        // An empty vector has no buffer to copy into.
+        if (size > 0) {
+            memcpy(values.data(), bytes, size * sizeof(T));
+        }
+        return values;
+    }
+
+    string read_string() {
+        uint64_t size = read<uint64_t>();
+        if (size > data.size()) {
+            throw runtime_error("Truncated data");
+        }
+        return string(take(size), size);
+    }
+
+private:
+    string_view data;
+    size_t offset = 0;
+
+    const char* take(size_t size) {
+        if (offset + size > data.size()) {
+            throw runtime_error("Truncated data");
+        }
+        const char* start = data.data() + offset;
+        offset += size;
+        return start;
+    }
+};
+
+// Index of the slots (schedule indices) in which each team plays. Every team's slots are kept in a sorted flat
+// array and every slot stores a back-pointer to its position in both of its teams' arrays, so the neighbouring 
+// games of a team can be found in O(1) for a slot the team plays in and in O(log n) for any other slot.
+class TeamGameIndex {
+public:
+    // Build the index from scratch for the given schedule.
+    void build(const Schedule& schedule) {
+        team_games = vector<vector<int>>(schedule.num_teams());
+        slots = vector<SlotEntry>(schedule.size());
+        cursors = vector<int>(schedule.num_teams());
+        stamps = vector<int>(schedule.num_teams(), 0);
+        current_stamp = 0;
+        for (int i = 0; i < schedule.size(); i++) {
+            for (int side = 0; side < 2; side++) {
+                TeamId team = schedule.teams[side][i];
+                slots[i].teams[side] = team;
+                slots[i].positions[side] = team_games[team].size();
+                team_games[team].push_back(i);
             }
         }
+    }
 
-        // Initialize the set of worst games.
-        refresh_worst_games();
+    int num_teams() const { return team_games.size(); }
+    // The sorted slots in which the given team plays.
+    const vector<int>& games(int team_id) const { return team_games[team_id]; }
+    TeamId team_at(int idx, int side) const { return slots[idx].teams[side]; }
+    // The position of the game at slot idx in the array of the team playing on the given side.
+    int position_at(int idx, int side) const { return slots[idx].positions[side]; }
+
+    // Return the slots of the games before and after the game at position pos in the team's array (-1 if it 
+    // doesn't exist).
+    pair<int, int> neighbors(int team_id, int pos) const {
+        const vector<int>& games = team_games[team_id];
+        int lower = pos > 0 ? games[pos - 1] : -1;
+        int upper = pos + 1 < games.size() ? games[pos + 1] : -1;
+        return {lower, upper};
     }
 
-    // Recompute the set of worst games.
-    void refresh_worst_games() {
-        cost_of_removing_game = vector<float>(schedule_length, 0.0);
-        for (auto const& curr : team_to_games) {
-            set<int> games = curr.second;
-            auto prev_it = games.begin();
-            auto curr_it = next(prev_it);
-            auto next_it = next(curr_it);
-
-            // Currently, prev_it is the first index and curr_it is the second index.
-            cost_of_removing_game[*prev_it] -= cost_func(*curr_it - *prev_it);
-            
-            while (next_it != games.end()) {
-                float curr_prev_cost = cost_func(*curr_it - *prev_it);
-                float next_curr_cost = cost_func(*next_it - *curr_it);
-                float next_prev_cost = cost_func(*next_it - *prev_it);
-                // If you remove this game, the cost will change since the two existing gaps will 
-                // be merged into one larger gap.
-                cost_of_removing_game[*curr_it] += next_prev_cost - curr_prev_cost - next_curr_cost;
+    // Return the slots of the team's games closest before and after idx (a slot the team doesn't play in), 
+    // ignoring the game at position excluded_pos in the team's array (-1 if it doesn't exist).
+    pair<int, int> neighbors_around(int team_id, int idx, int excluded_pos) const {
+        const vector<int>& games = team_games[team_id];
+        int rank = lower_bound(games.begin(), games.end(), idx) - games.begin();
+        int lower_pos = rank - 1;
+        if (lower_pos == excluded_pos) {
+            lower_pos--;
+        }
+        int upper_pos = rank;
+        if (upper_pos == excluded_pos) {
+            upper_pos++;
+        }
+        int lower = lower_pos >= 0 ? games[lower_pos] : -1;
+        int upper = upper_pos < games.size() ? games[upper_pos] : -1;
+        return {lower, upper};
+    }
 
-                // Update all the iterators
-                prev_it = curr_it;
-                curr_it = next_it;
-                ++next_it;
+    // Update the index to reflect the games at slots idx1 and idx2 being swapped.
+    void swap_slots(int idx1, int idx2) {
+        SlotEntry& entry1 = slots[idx1];
+        SlotEntry& entry2 = slots[idx2];
+        for (int side = 0; side < 2; side++) {
+            // Teams that play in both games keep the same set of slots, so only the other teams are moved.
+            if (!entry2.contains(entry1.teams[side])) {
+                entry1.positions[side] = relocate(entry1.teams[side], entry1.positions[side], idx2);
+            }
+            if (!entry1.contains(entry2.teams[side])) {
+                entry2.positions[side] = relocate(entry2.teams[side], entry2.positions[side], idx1);
+            }
+        }
+        swap(entry1, entry2);
+        // A team that plays in both games still occupies the same positions, but those positions now belong to 
+        // the other game.
+        for (int side1 = 0; side1 < 2; side1++) {
+            for (int side2 = 0; side2 < 2; side2++) {
+                if (entry1.teams[side1] == entry2.teams[side2]) {
+                    swap(entry1.positions[side1], entry2.positions[side2]);
+                }
             }
-            
-            // Currently, curr_it is the last index and prev_it is the second last index.
-            cost_of_removing_game[*curr_it] -= cost_func(*curr_it - *prev_it);
         }
-        
-        worst_games = get_n_lowest_indices(cost_of_removing_game, num_worst_games);
     }
 
-    // Iterate over arr and return the indices of the n lowest values.
-    vector<int> get_n_lowest_indices(vector<float>& arr, int n) {
-        // If arr doesn't have n elements or more, it is impossible to return the indices of the n 
-        // lowest elements.
-        assert(arr.size() >= n);
-        
-        // Create a helper struct to compare tuples based on the first element ("<" is used to create 
-        // a max heap).
-        struct compare {
-            bool operator()(const tuple<int, int>& a, const tuple<int, int>& b) {
-                return get<0>(a) < get<0>(b);
+    // Update the index to reflect the games in slots [lo, lo + sources.size()) being rearranged so that slot 
+    // lo + k holds the game that was at slot sources[k] (which must be a permutation of the same range). Every 
+    // team keeps the same positions in its array, so only the values of its run of games in the range change.
+    void permute_range(int lo, const vector<int>& sources) {
+        int hi = lo + sources.size();
+        moved_entries.assign(slots.begin() + lo, slots.begin() + hi);
+        if (++current_stamp == 0) {
+            fill(stamps.begin(), stamps.end(), 0);
+            current_stamp = 1;
+        }
+        for (int idx = lo; idx < hi; idx++) {
+            SlotEntry& entry = slots[idx];
+            entry = moved_entries[sources[idx - lo] - lo];
+            // Each team's run is rewritten in slot order, starting from the first position of the run.
+            for (int side = 0; side < 2; side++) {
+                TeamId team = entry.teams[side];
+                vector<int>& games = team_games[team];
+                if (stamps[team] != current_stamp) {
+                    stamps[team] = current_stamp;
+                    cursors[team] = lower_bound(games.begin(), games.end(), lo) - games.begin();
+                }
+                games[cursors[team]] = idx;
+                entry.positions[side] = cursors[team]++;
             }
-        };
-        
-        priority_queue<tuple<float, int>, vector<tuple<float, int>>, compare> max_heap;
-        // Initialize the max heap with the first n elements in arr.
-        for (int i = 0; i < n; i++) {
-            max_heap.push(make_tuple(arr[i], i));
         }
+    }
 
-        // For each remaining element in arr, if the element is less than the maximum element in the 
-        // max heap, then replace the top element with the this element.
-        for (int i = n; i < arr.size(); i++) {
-            if (arr[i] < get<0>(max_heap.top())) {
-                max_heap.pop();
-                max_heap.push(make_tuple(arr[i], i));
+    // Update the index to reflect teams a and b trading places in every game.
+    void swap_teams(TeamId a, TeamId b) {
+        for (int idx : team_games[a]) {
+            SlotEntry& entry = slots[idx];
+            if (entry.contains(b)) {
+                // In a game between the two teams they trade sides, but each side keeps its position, since the 
+                // teams' arrays are traded as well.
+                swap(entry.teams[0], entry.teams[1]);
+            } else {
+                entry.teams[entry.side_of(a)] = b;
+            }
+        }
+        for (int idx : team_games[b]) {
+            SlotEntry& entry = slots[idx];
+            if (!entry.contains(a)) {
+                entry.teams[entry.side_of(b)] = a;
             }
         }
+        swap(team_games[a], team_games[b]);
+    }
 
-        // Create a vector with all the indices in the max heap.
-        vector<int> idxs_found;
-        while (!max_heap.empty()) {
-            idxs_found.push_back(get<1>(max_heap.top()));
-            max_heap.pop();
+    // Update the index to reflect a game between teams a and b being inserted at slot idx, which moves every later 
+    // game one slot later.
+    void insert_slot(int idx, TeamId a, TeamId b) {
+        shift_slots(idx, 1);
+        slots.insert(slots.begin() + idx, SlotEntry{{a, b}, {0, 0}});
+        for (int side = 0; side < 2; side++) {
+            TeamId team = slots[idx].teams[side];
+            vector<int>& games = team_games[team];
+            int rank = lower_bound(games.begin(), games.end(), idx) - games.begin();
+            games.insert(games.begin() + rank, idx);
+            slots[idx].positions[side] = rank;
+            for (int pos = rank + 1; pos < games.size(); pos++) {
+                set_position(games[pos], team, pos);
+            }
         }
+    }
 
-        return idxs_found;
+    // Update the index to reflect the game at slot idx being removed, which moves every later game one slot 
+    // earlier.
+    void remove_slot(int idx) {
+        for (int side = 0; side < 2; side++) {
+            TeamId team = slots[idx].teams[side];
+            vector<int>& games = team_games[team];
+            games.erase(games.begin() + slots[idx].positions[side]);
+            for (int pos = slots[idx].positions[side]; pos < games.size(); pos++) {
+                set_position(games[pos], team, pos);
+            }
+        }
+        slots.erase(slots.begin() + idx);
+        shift_slots(idx + 1, -1);
     }
 
-    // Choose a swap of indices by either 1) randomly selecting two of the games that are contributing 
-    // the most to the cost or 2) randomly selecting 2 games.
-    vector<int> choose_swap() {
-        // There is a 1/2 chance of choosing a random swap and a 1/2 chance of choosing a swap from the 
-        // curated list of games.
-        if (rand() % 3 == 0) {
-            int idx1 = rand() % schedule_length;
-            int idx2;
-            // Ensure that the two indices chosen aren't the same.
-            do {
-                idx2 = rand() % schedule_length;
-            } while (idx1 == idx2);
-            
-            return {idx1, idx2};
+private:
+    struct SlotEntry {
+        TeamId teams[2];
+        int positions[2];
+
+        bool contains(int team_id) const { return teams[0] == team_id || teams[1] == team_id; }
+        int side_of(int team_id) const { return teams[0] == team_id ? 0 : 1; }
+    };
+
+    // The sorted slots in which each team plays.
+    vector<vector<int>> team_games;
+    // The teams playing at each slot and the positions of the slot in their arrays.
+    vector<SlotEntry> slots;
+    // Scratch space for permute_range: a copy of the permuted entries, and the next position to write in the 
+    // array of every team (valid for the teams whose stamp matches current_stamp).
+    vector<SlotEntry> moved_entries;
+    vector<int> cursors;
+    vector<int> stamps;
+    int current_stamp = 0;
+
+    // Move the team's game at position pos to new_idx (a slot the team doesn't play in) by shifting the games in 
+    // between, and return the new position of the game.
+    int relocate(int team_id, int pos, int new_idx) {
+        vector<int>& games = team_games[team_id];
+        int rank = lower_bound(games.begin(), games.end(), new_idx) - games.begin();
+        if (rank > pos) {
+            // The game moves right, so every game in between moves one position to the left.
+            for (int i = pos; i < rank - 1; i++) {
+                games[i] = games[i + 1];
+                set_position(games[i], team_id, i);
+            }
+            rank--;
         } else {
-            int idx1 = rand() % num_worst_games;
-            int idx2;
-            // Ensure that the two indices chosen aren't the same.
-            do {
-                idx2 = rand() % num_worst_games;
-            } while (idx1 == idx2);
-            
-            return {worst_games[idx1], worst_games[idx2]};
+            // The game moves left, so every game in between moves one position to the right.
+            for (int i = pos; i > rank; i--) {
+                games[i] = games[i - 1];
+                set_position(games[i], team_id, i);
+            }
         }
+        games[rank] = new_idx;
+        return rank;
+    }
+
+    void set_position(int idx, int team_id, int pos) {
+        slots[idx].positions[slots[idx].side_of(team_id)] = pos;
     }
 
-    // This function returns the values at the closest index less than and greater than the given 
-    // index (so, this function returns a vector with length 2).
-    vector<int> get_lower_upper_bounds(set<int>& games, int idx, vector<int> idxs_to_exclude = {}) {
-        // Determine the closest index greater than the given index.
-        set<int>::iterator upper_bound_iter = upper_bound(games.begin(), games.end(), idx);
-        // If the index is not allowed as the upper bound, push it forward one.
-        while (find(idxs_to_exclude.begin(), idxs_to_exclude.end(), *upper_bound_iter) != idxs_to_exclude.end()) {
-            upper_bound_iter = next(upper_bound_iter);
+    // Add delta to every slot from first onwards in the teams' arrays (the arrays are sorted, so only their tails 
+    // change and they stay sorted).
+    void shift_slots(int first, int delta) {
+        for (vector<int>& games : team_games) {
+            for (auto it = lower_bound(games.begin(), games.end(), first); it != games.end(); ++it) {
+                *it += delta;
+            }
         }
-        
-        set<int>::iterator lower_bound_iter;
-        int upper_bound;
-        int lower_bound;
-        
-        if (upper_bound_iter == games.end() || *upper_bound_iter < idx) {
-            // If there are no indices greater than the given index, the upper value is -1 and the 
-            // lower index is the last index in the set.
-            lower_bound_iter = prev(games.end());
-            upper_bound = -1;
-        } else {
-            // Otherwise, the found index contains the upper value and the lower index is the index 
-            // right before the upper index.
-            lower_bound_iter = prev(upper_bound_iter);
-            upper_bound = *upper_bound_iter;
+    }
+};
+
+// Hard rules that no move may break: consecutive games of a team must be more than rest_slots slots apart, a team 
+// can't play in the slots blacked out for it, and a team plays at most once in every round of round_length slots. 
+// The slots each team plays in and is blacked out of are kept as bitsets and the games of every team in every round 
+// are counted, so checking whether a team's game can move to another slot takes constant time. A move is only 
+// rejected if it would add violations, so a schedule that starts out infeasible can still be improved.
+class HardConstraints {
+public:
+    void build(const Schedule& schedule, int rest_slots, int round_length, 
+               const vector<pair<TeamId, int>>& blackouts) {
+        this->rest_slots = rest_slots;
+        this->round_length = round_length;
+        enabled = rest_slots > 0 || round_length > 0 || !blackouts.empty();
+        // Nothing is tracked without any rules.
+        words_per_team = enabled ? (schedule.size() + 63) / 64 : 0;
+        num_rounds = enabled && round_length > 0 ? (schedule.size() + round_length - 1) / round_length : 0;
+        occupied = vector<uint64_t>(schedule.num_teams() * words_per_team, 0);
+        blacked_out = vector<uint64_t>(schedule.num_teams() * words_per_team, 0);
+        round_games = vector<uint16_t>(schedule.num_teams() * num_rounds, 0);
+        for (auto [team, idx] : blackouts) {
+            assert(team < schedule.num_teams() && idx >= 0 && idx < schedule.size());
+            set_bit(blacked_out, team, idx);
+        }
+        for (int i = 0; enabled && i < schedule.size(); i++) {
+            add(schedule.teams[0][i], i);
+            add(schedule.teams[1][i], i);
         }
+    }
+
+    bool active() const { return enabled; }
 
-        // If the index is not allowed as the lower bound, push it backward one.
-        while (lower_bound_iter != prev(games.begin()) && find(idxs_to_exclude.begin(), idxs_to_exclude.end(), *lower_bound_iter) != idxs_to_exclude.end()) {
-            lower_bound_iter = prev(lower_bound_iter);
+    // Whether the team's game at from_idx can move to to_idx (a slot the team doesn't play in) without breaking 
+    // any rule at to_idx.
+    bool allows_move(TeamId team, int from_idx, int to_idx) const {
+        if (test_bit(blacked_out, team, to_idx)) {
+            return false;
         }
-        
-        if (lower_bound_iter == prev(games.begin())) {
-            // If the lower index is out of range, set the lower bound to -1.
-            lower_bound = -1;
-        } else {
-            // If the lower index is in range, set the lower bound to the value at the lower index.
-            lower_bound = *lower_bound_iter;
+        if (rest_slots > 0 && plays_within(team, to_idx - rest_slots, to_idx + rest_slots, from_idx)) {
+            return false;
         }
-        
-        return {lower_bound, upper_bound};
+        if (round_length > 0 && to_idx / round_length != from_idx / round_length 
+            && round_games[team * num_rounds + to_idx / round_length] > 0) {
+            return false;
+        }
+        return true;
     }
 
-    // Calculate the change in cost from swapping the matchups at idx1 and idx2.
-    float calculate_cost_change(int idx1, int idx2) {
-        // If no swap is being made, the score won't change.
-        if (idx1 == idx2) {
-            return 0.0;
+    // The change in the number of violations for a team whose games at old_slots (consecutive games of the team, 
+    // between its games at lower and upper, either of which may be -1) move to new_slots (sorted).
+    int violation_change(TeamId team, int lower, const int* old_slots, const int* new_slots, int count, int upper) {
+        int change = run_violations(team, lower, new_slots, count, upper) 
+            - run_violations(team, lower, old_slots, count, upper);
+        if (round_length > 0) {
+            // Count the games that share a round with another game of the team by tentatively moving the games.
+            for (int i = 0; i < count; i++) {
+                change -= --round_games[team * num_rounds + old_slots[i] / round_length] > 0;
+            }
+            for (int i = 0; i < count; i++) {
+                change += round_games[team * num_rounds + new_slots[i] / round_length]++ > 0;
+            }
+            for (int i = 0; i < count; i++) {
+                round_games[team * num_rounds + new_slots[i] / round_length]--;
+                round_games[team * num_rounds + old_slots[i] / round_length]++;
+            }
         }
-        
-        // Ensure that idx1 is less than idx2.
-        if (idx1 > idx2) {
-           swap(idx1, idx2);
+        return change;
+    }
+
+    // Whether the two teams can trade all of their games. Rests and rounds only depend on the sets of slots, which 
+    // the teams trade, so only the blackouts can add violations.
+    bool allows_swap_teams(TeamId team1, TeamId team2) const {
+        int before = 0;
+        int after = 0;
+        for (int w = 0; w < words_per_team; w++) {
+            uint64_t games1 = occupied[team1 * words_per_team + w];
+            uint64_t games2 = occupied[team2 * words_per_team + w];
+            uint64_t blackouts1 = blacked_out[team1 * words_per_team + w];
+            uint64_t blackouts2 = blacked_out[team2 * words_per_team + w];
+            before += popcount(games1 & blackouts1) + popcount(games2 & blackouts2);
+            after += popcount(games2 & blackouts1) + popcount(games1 & blackouts2);
         }
+        return after <= before;
+    }
 
-        vector<string> game1 = schedule[idx1];
-        vector<string> game2 = schedule[idx2];
-        
-        float cost_change = 0.0;
+    void add(TeamId team, int idx) {
+        set_bit(occupied, team, idx);
+        if (round_length > 0) {
+            round_games[team * num_rounds + idx / round_length]++;
+        }
+    }
 
-        // Calculate the cost change for each team in the first game.
-        for (string team : game1) {
-            // If the team is in the second game as well, then the swap won't affect the cost.
-            if (team == game2[0] || team == game2[1]) {
-                continue;
-            }
+    void remove(TeamId team, int idx) {
+        occupied[team * words_per_team + idx / 64] &= ~(1ULL << (idx % 64));
+        if (round_length > 0) {
+            round_games[team * num_rounds + idx / round_length]--;
+        }
+    }
 
-            set<int>& curr_games = team_to_games[team];
+    void move(TeamId team, int from_idx, int to_idx) {
+        remove(team, from_idx);
+        add(team, to_idx);
+    }
 
-            // Determine the indices of games with this team to the left and right of this game (-1 if 
-            // it doesn't exist).
-            vector<int> from_bounds = get_lower_upper_bounds(curr_games, idx1, {idx1});
-            int from_lower_bound_idx = from_bounds[0];
-            int from_upper_bound_idx = from_bounds[1];
+    // Update the bitsets to reflect the two teams trading all of their games (the blackouts stay with the teams).
+    void swap_teams(TeamId team1, TeamId team2) {
+        swap_ranges(occupied.begin() + team1 * words_per_team, occupied.begin() + (team1 + 1) * words_per_team, 
+                    occupied.begin() + team2 * words_per_team);
+        swap_ranges(round_games.begin() + team1 * num_rounds, round_games.begin() + (team1 + 1) * num_rounds, 
+                    round_games.begin() + team2 * num_rounds);
+    }
 
-            // Determine the indices of games with this team to the left and right of the new swapped 
-            // position of this game (-1 if it doesn't exist).
-            vector<int> to_bounds = get_lower_upper_bounds(curr_games, idx2, {idx1});
-            int to_lower_bound_idx = to_bounds[0];
-            int to_upper_bound_idx = to_bounds[1];
-            
-            // First, calculate the change in cost of removing the current game.
-            if (from_lower_bound_idx == -1) {
-                assert(from_upper_bound_idx != -1);
-                // By removing this game, the cost will be reduced by the cost based on the gap between this 
-                // game and the next game with this team.
-                cost_change -= cost_func(from_upper_bound_idx - idx1);
-            } else if (from_upper_bound_idx == -1) {
-                assert(from_lower_bound_idx != -1);
-                // By removing this game, the cost will be reduced by the cost based on the gap between this 
-                // game and the previous game with this team.
-                cost_change -= cost_func(idx1 - from_lower_bound_idx);
-            } else {
-                // By removing this game, the cost will be reduced by the costs based on both the gap with the 
-                // next game and the gap with the previous game.
-                cost_change -= cost_func(from_upper_bound_idx - idx1) + cost_func(idx1 - from_lower_bound_idx);
-                // Now, only a single gap remains - the gap between the next and previous games. Increase the cost 
-                // based on this gap.
-                cost_change += cost_func(from_upper_bound_idx - from_lower_bound_idx);
-            }
-
-            // Second, calculate the change in cost of adding the new game.
-            if (to_lower_bound_idx == -1) {
-                assert(to_upper_bound_idx != -1);
-                // By adding this game, the cost will be increased by the cost based on the gap between this 
-                // game and the next game with this team.
-                cost_change += cost_func(to_upper_bound_idx - idx2);
-            } else if (to_upper_bound_idx == -1) {
-                assert(to_lower_bound_idx != -1);
-                // By adding this game, the cost will be increased by the cost based on the gap between this 
-                // game and the previous game with this team.
-                cost_change += cost_func(idx2 - to_lower_bound_idx);
-            } else {
-                // By adding this game, the cost will be increased by the costs based on both the gap with the 
-                // next game and the gap with the previous game.
-                cost_change += cost_func(to_upper_bound_idx - idx2) + cost_func(idx2 - to_lower_bound_idx);
-                // Now, the gap the next and previous games has been split. Decrease the cost based on the gap 
-                // that was originally present (since that gap has now been split and no longer exists).
-                cost_change -= cost_func(to_upper_bound_idx - to_lower_bound_idx);
+    // Count the violations in the whole schedule.
+    int count_violations(const TeamGameIndex& index) const {
+        int violations = 0;
+        for (int team = 0; enabled && team < index.num_teams(); team++) {
+            const vector<int>& games = index.games(team);
+            violations += run_violations(team, -1, games.data(), games.size(), -1);
+            for (int round = 0; round < num_rounds; round++) {
+                violations += max(0, round_games[team * num_rounds + round] - 1);
             }
         }
+        return violations;
+    }
 
-        // Calculate the cost change for each team in the second game.
-        for (string team : game2) {
-            // If the team is in the first game as well, then the swap won't affect the cost.
-            if (team == game1[0] || team == game1[1]) {
-                continue;
-            }
+private:
+    bool enabled = false;
+    int rest_slots = 0;
+    int round_length = 0;
+    int words_per_team = 0;
+    int num_rounds = 0;
+    // One bitset of slots per team (words_per_team words each) for the games it plays and the slots it can't play in.
+    vector<uint64_t> occupied;
+    vector<uint64_t> blacked_out;
+    // The number of games of every team in every round (num_rounds counters per team).
+    vector<uint16_t> round_games;
 
-            set<int>& curr_games = team_to_games[team];
+    void set_bit(vector<uint64_t>& bits, TeamId team, int idx) {
+        bits[team * words_per_team + idx / 64] |= 1ULL << (idx % 64);
+    }
 
-            // Determine the indices of games with this team to the left and right of this game (-1 if 
-            // it doesn't exist).
-            vector<int> from_bounds = get_lower_upper_bounds(curr_games, idx2, {idx2});
-            int from_lower_bound_idx = from_bounds[0];
-            int from_upper_bound_idx = from_bounds[1];
+    bool test_bit(const vector<uint64_t>& bits, TeamId team, int idx) const {
+        return bits[team * words_per_team + idx / 64] >> (idx % 64) & 1;
+    }
 
-            // Determine the indices of games with this team to the left and right of the new swapped 
-            // position of this game (-1 if it doesn't exist).
-            vector<int> to_bounds = get_lower_upper_bounds(curr_games, idx1, {idx2});
-            int to_lower_bound_idx = to_bounds[0];
-            int to_upper_bound_idx = to_bounds[1];
-            
-            // First, calculate the change in cost of removing the current game.
-            if (from_lower_bound_idx == -1) {
-                assert(from_upper_bound_idx != -1);
-                // By removing this game, the cost will be reduced by the cost based on the gap between this 
-                // game and the next game with this team.
-                cost_change -= cost_func(from_upper_bound_idx - idx2);
-            } else if (from_upper_bound_idx == -1) {
-                assert(from_lower_bound_idx != -1);
-                // By removing this game, the cost will be reduced by the cost based on the gap between this 
-                // game and the previous game with this team.
-                cost_change -= cost_func(idx2 - from_lower_bound_idx);
-            } else {
-                // By removing this game, the cost will be reduced by the costs based on both the gap with the 
-                // next game and the gap with the previous game.
-                cost_change -= cost_func(from_upper_bound_idx - idx2) + cost_func(idx2 - from_lower_bound_idx);
-                // Now, only a single gap remains - the gap between the next and previous games. Increase the cost 
-                // based on this gap.
-                cost_change += cost_func(from_upper_bound_idx - from_lower_bound_idx);
-            }
-
-            // Second, calculate the change in cost of adding the new game.
-            if (to_lower_bound_idx == -1) {
-                assert(to_upper_bound_idx != -1);
-                // By adding this game, the cost will be increased by the cost based on the gap between this 
-                // game and the next game with this team.
-                cost_change += cost_func(to_upper_bound_idx - idx1);
-            } else if (to_upper_bound_idx == -1) {
-                assert(to_lower_bound_idx != -1);
-                // By adding this game, the cost will be increased by the cost based on the gap between this 
-                // game and the previous game with this team.
-                cost_change += cost_func(idx1 - to_lower_bound_idx);
-            } else {
-                // By adding this game, the cost will be increased by the costs based on both the gap with the 
-                // next game and the gap with the previous game.
-                cost_change += cost_func(to_upper_bound_idx - idx1) + cost_func(idx1 - to_lower_bound_idx);
-                // Now, the gap the next and previous games has been split. Decrease the cost based on the gap 
-                // that was originally present (since that gap has now been split and no longer exists).
-                cost_change -= cost_func(to_upper_bound_idx - to_lower_bound_idx);
+    // Whether the team plays in any slot in [lo, hi] other than excluded (only a word or two for short rests).
+    bool plays_within(TeamId team, int lo, int hi, int excluded) const {
+        lo = max(lo, 0);
+        hi = min(hi, words_per_team * 64 - 1);
+        const uint64_t* bits = &occupied[team * words_per_team];
+        for (int w = lo / 64; w <= hi / 64; w++) {
+            uint64_t word = bits[w];
+            if (w == lo / 64) {
+                word &= ~0ULL << (lo % 64);
+            }
+            if (w == hi / 64) {
+                word &= ~0ULL >> (63 - hi % 64);
+            }
+            if (w == excluded / 64) {
+                word &= ~(1ULL << (excluded % 64));
+            }
+            if (word != 0) {
+                return true;
             }
         }
-        
-        return cost_change;
+        return false;
     }
 
-    // Calculate the cost of the entire schedule as a function of the distances between games.
-    float calculate_schedule_cost(bool print_gaps = false) {
-        float schedule_cost = 0.0;
-        for (const auto& curr : team_to_games) {
-            if (print_gaps) { cout << curr.first << ":"; }
-            // Iterate over the set of games for the current team and calculate the cost.
-            auto it = curr.second.begin();
-            auto prev = it;
-            ++it;
-            for (; it != curr.second.end(); ++it) {
-                int gap = *it - *prev;
-                schedule_cost += cost_func(gap);
-                if (print_gaps) { cout << " " << gap; }
-                prev = it;
+    // The rest and blackout violations of a team's consecutive games at slots (and the gaps to lower and upper).
+    int run_violations(TeamId team, int lower, const int* slots, int count, int upper) const {
+        int violations = 0;
+        int previous = lower;
+        for (int i = 0; i < count; i++) {
+            violations += test_bit(blacked_out, team, slots[i]);
+            violations += previous != -1 && slots[i] - previous <= rest_slots;
+            previous = slots[i];
+        }
+        violations += previous != -1 && upper != -1 && upper - previous <= rest_slots;
+        return violations;
+    }
+};
+
+// Binary heap of (key, id) entries that also tracks the position of every id, so that the key of any entry can 
+// be changed in O(log n). The entry at the top is the one for which no other entry compares before it.
+template <typename Compare>
+class IndexedHeap {
+public:
+    // Replace the contents of the heap with the given entries. Ids must be less than max_id.
+    void assign(vector<pair<float, int>> entries, int max_id) {
+        heap = move(entries);
+        positions = vector<int>(max_id, -1);
+        for (int i = 0; i < heap.size(); i++) {
+            positions[heap[i].second] = i;
+        }
+        for (int i = (int) heap.size() / 2 - 1; i >= 0; i--) {
+            sift_down(i);
+        }
+    }
+
+    int size() const { return heap.size(); }
+    bool empty() const { return heap.empty(); }
+    bool contains(int id) const { return positions[id] != -1; }
+    const pair<float, int>& top() const { return heap[0]; }
+    // The entries in heap order (assigning them back reproduces the same heap).
+    const vector<pair<float, int>>& entries() const { return heap; }
+    // The id stored at the given position of the heap (used to sample entries uniformly).
+    int id_at(int i) const { return heap[i].second; }
+
+    void update(int id, float key) {
+        int i = positions[id];
+        heap[i].first = key;
+        sift_down(sift_up(i));
+    }
+
+    // Replace the top entry with the given entry and return the entry that was removed.
+    pair<float, int> replace_top(pair<float, int> entry) {
+        pair<float, int> removed = heap[0];
+        positions[removed.second] = -1;
+        heap[0] = entry;
+        positions[entry.second] = 0;
+        sift_down(0);
+        return removed;
+    }
+
+private:
+    vector<pair<float, int>> heap;
+    vector<int> positions;
+    Compare compare;
+
+    int sift_up(int i) {
+        while (i > 0) {
+            int parent = (i - 1) / 2;
+            if (!compare(heap[i].first, heap[parent].first)) {
+                break;
             }
-            if (print_gaps) { cout << endl; }
+            swap_entries(i, parent);
+            i = parent;
         }
-        return schedule_cost;
+        return i;
     }
 
-    // Calculate distribution statistics for the gaps.
-    string calculate_gap_dist() {
-        vector<int> gaps;
-        for (const auto& curr : team_to_games) {
-            // Iterate over the set of games for the current team and calculate the gap.
-            auto it = curr.second.begin();
-            auto prev = it;
-            ++it;
-            for (; it != curr.second.end(); ++it) {
-                int gap = *it - *prev;
-                gaps.push_back(gap);
-                prev = it;
+    void sift_down(int i) {
+        while (true) {
+            int best = i;
+            int left = 2 * i + 1;
+            int right = left + 1;
+            if (left < heap.size() && compare(heap[left].first, heap[best].first)) {
+                best = left;
             }
+            if (right < heap.size() && compare(heap[right].first, heap[best].first)) {
+                best = right;
+            }
+            if (best == i) {
+                return;
+            }
+            swap_entries(i, best);
+            i = best;
         }
+    }
+
+    void swap_entries(int i, int j) {
+        swap(heap[i], heap[j]);
+        positions[heap[i].second] = i;
+        positions[heap[j].second] = j;
+    }
+};
 
-        sort(gaps.begin(), gaps.end());
+// The pool of the n games with the lowest cost of removal. The pool is kept as a max heap (so its best candidate 
+// for eviction is on top) and the remaining games as a min heap (so the best candidate for promotion is on top), 
+// which lets a change to a single game's cost be absorbed in O(log n) instead of rebuilding the whole pool.
+class WorstGamesPool {
+public:
+    void build(const vector<float>& costs, int n) {
+        assert(costs.size() >= n);
+        vector<pair<float, int>> entries;
+        for (int i = 0; i < costs.size(); i++) {
+            entries.push_back({costs[i], i});
+        }
+        nth_element(entries.begin(), entries.begin() + n, entries.end());
+        vector<pair<float, int>> others(entries.begin() + n, entries.end());
+        entries.resize(n);
+        pool.assign(move(entries), costs.size());
+        rest.assign(move(others), costs.size());
+    }
 
-        int min_gap = *gaps.begin();
-        int percentile_25_gap = *next(gaps.begin(), gaps.size() / 4);
-        int percentile_50_gap = *next(gaps.begin(), gaps.size() / 2);
-        int percentile_75_gap = *next(gaps.begin(), 3 * gaps.size() / 4);
-        int max_gap = *prev(gaps.end());
+    int size() const { return pool.size(); }
+    int operator[](int i) const { return pool.id_at(i); }
 
-        return to_string(min_gap) + '/' + to_string(percentile_25_gap) + '/' + to_string(percentile_50_gap) + '/' + to_string(percentile_75_gap) + '/' + to_string(max_gap);
+    // The layout of the heaps determines which game is sampled, so it is saved exactly.
+    void save(BinaryWriter& out) const {
+        save_entries(out, pool.entries());
+        save_entries(out, rest.entries());
     }
 
-    // This is the cost function used to evaluate a single gap in the schedule.
-    float cost_func(int gap) {
-        // The target gap between conseuquent games for a given team is equal to num_teams / 2.
-        return pow(abs((num_teams / 2.0) - abs(gap)), deviation_exponent);
+    // Restore the saved pool, which must hold every one of the num_games games exactly once (with at least one in 
+    // the pool).
+    void load(BinaryReader& in, int num_games) {
+        vector<pair<float, int>> pool_entries = load_entries(in);
+        vector<pair<float, int>> rest_entries = load_entries(in);
+        vector<bool> seen(num_games, false);
+        for (const vector<pair<float, int>>* entries : {&pool_entries, &rest_entries}) {
+            for (auto [cost, idx] : *entries) {
+                if (idx < 0 || idx >= num_games || seen[idx]) {
+                    throw runtime_error("Worst games don't match the schedule");
+                }
+                seen[idx] = true;
+            }
+        }
+        if (pool_entries.size() + rest_entries.size() != num_games || (num_games > 0 && pool_entries.empty())) {
+            throw runtime_error("Worst games don't match the schedule");
+        }
+        pool.assign(move(pool_entries), num_games);
+        rest.assign(move(rest_entries), num_games);
     }
 
-    // Print the current schedule.
-    void print_schedule() {
-        for (int i = 0; i < schedule_length; i++) {
-            cout << schedule[i][0] << " vs " << schedule[i][1] << endl;
+    // Record a new cost for the given game, moving it in or out of the pool if necessary.
+    void update(int idx, float cost) {
+        if (pool.contains(idx)) {
+            pool.update(idx, cost);
+        } else {
+            rest.update(idx, cost);
+        }
+        // A single change can only leave one game on the wrong side of the partition.
+        if (!rest.empty() && rest.top().first < pool.top().first) {
+            pair<float, int> promoted = rest.top();
+            pair<float, int> evicted = pool.replace_top(promoted);
+            rest.replace_top(evicted);
         }
     }
 
-    void print_team_to_games() {
-        for (const auto& curr : team_to_games) {
-            cout << curr.first << ": ";
-            for (int game : curr.second) {
-                cout << game << " ";
-            }
-            cout << endl;
+private:
+    IndexedHeap<greater<float>> pool;
+    IndexedHeap<less<float>> rest;
+
+    static void save_entries(BinaryWriter& out, const vector<pair<float, int>>& entries) {
+        vector<float> costs;
+        vector<int> idxs;
+        for (auto [cost, idx] : entries) {
+            costs.push_back(cost);
+            idxs.push_back(idx);
         }
+        out.write_vector(costs);
+        out.write_vector(idxs);
     }
 
-    void print_worst_games() {
-        for (int game : worst_games) {
-            cout << game << " ";
+    static vector<pair<float, int>> load_entries(BinaryReader& in) {
+        vector<float> costs = in.read_vector<float>();
+        vector<int> idxs = in.read_vector<int>();
+        if (costs.size() != idxs.size()) {
+            throw runtime_error("Mismatched worst games");
         }
-        cout << endl;
+        vector<pair<float, int>> entries;
+        for (int i = 0; i < costs.size(); i++) {
+            entries.push_back({costs[i], idxs[i]});
+        }
+        return entries;
     }
 };
 
-vector<vector<string>> parse_schedule(string schedule_str) {
-    stringstream ss(schedule_str);
-    vector<vector<string>> schedule;
-    
-    int split_loc;
-    int i = 0;
-    string t;
-    while (getline(ss, t, ';')) {
-        split_loc = t.find(',');
-        string team1 = t.substr(0, split_loc);
-        string team2 = t.substr(split_loc + 1);
-        vector<string> game = {team1, team2};
-        schedule.push_back(game);
-        i++;
+// Cache of the cost changes of swaps, keyed by the pair of slots. A swap's cost change only depends on the games 
+// of the (up to four) teams playing in the two games, so every entry records those teams and their versions when 
+// the change was computed, and moving any game of a team bumps the team's version. An entry is therefore used 
+// only while none of those teams' games have moved, and an accepted swap invalidates just the entries of the 
+// teams it touched. The cache is direct mapped: a new entry replaces whatever was in its bucket.
+class SwapDeltaCache {
+public:
+    // Empty the cache and give it 2^size_log2 buckets for a schedule of num_teams teams.
+    void reset(int num_teams, int size_log2) {
+        entries.assign(size_t(1) << size_log2, Entry());
+        mask = entries.size() - 1;
+        versions.assign(num_teams, 0);
     }
 
+    // Return the cached cost change of swapping the games at idx1 and idx2 (idx1 < idx2), played by the given 
+    // teams (the two teams at idx1 and then the two at idx2), if it is still valid.
+    optional<float> find(int idx1, int idx2, const array<TeamId, 4>& teams) {
+        const Entry& entry = entries[bucket(idx1, idx2)];
+        if (entry.idx1 == idx1 && entry.idx2 == idx2 && entry.teams == teams && current(entry)) {
+            hits++;
+            return entry.delta;
+        }
+        misses++;
+        return nullopt;
+    }
+
+    void store(int idx1, int idx2, const array<TeamId, 4>& teams, float delta) {
+        Entry& entry = entries[bucket(idx1, idx2)];
+        entry.idx1 = idx1;
+        entry.idx2 = idx2;
+        entry.teams = teams;
+        for (int i = 0; i < 4; i++) {
+            entry.versions[i] = versions[teams[i]];
+        }
+        entry.delta = delta;
+    }
+
+    // Invalidate the entries of every swap involving the team.
+    void bump(TeamId team) { versions[team]++; }
+
+    // Invalidate every entry (for changes that move every slot, such as inserting a game).
+    void clear() { fill(entries.begin(), entries.end(), Entry()); }
+
+    long get_hits() const { return hits; }
+    long get_misses() const { return misses; }
+
+private:
+    struct Entry {
+        int idx1 = -1;
+        int idx2 = -1;
+        array<TeamId, 4> teams;
+        array<uint32_t, 4> versions;
+        float delta;
+    };
+
+    vector<Entry> entries;
+    size_t mask = 0;
+    // The version of every team.
+    vector<uint32_t> versions;
+    long hits = 0;
+    long misses = 0;
+
+    size_t bucket(int idx1, int idx2) const { return (idx1 * 0x9E3779B1u ^ idx2 * 0x85EBCA77u) & mask; }
+
+    bool current(const Entry& entry) const {
+        for (int i = 0; i < 4; i++) {
+            if (versions[entry.teams[i]] != entry.versions[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// Fast pseudo-random number generator (xoshiro256**). Each annealer owns one, so annealers on different threads 
+// never share random state. It also satisfies UniformRandomBitGenerator so it can be used with <random>.
+class FastRng {
+public:
+    using result_type = uint64_t;
+
+    explicit FastRng(uint64_t seed = 1) { set_seed(seed); }
+
+    // Reset the generator to the sequence determined by seed. The state is filled using splitmix64 so that 
+    // similar seeds still produce unrelated sequences.
+    void set_seed(uint64_t seed) {
+        for (uint64_t& s : state) {
+            seed += 0x9e3779b97f4a7c15;
+            uint64_t z = seed;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+            s = z ^ (z >> 31);
+        }
+    }
+
+    static constexpr uint64_t min() { return 0; }
+    static constexpr uint64_t max() { return numeric_limits<uint64_t>::max(); }
+
+    uint64_t operator()() {
+        uint64_t result = rotl(state[1] * 5, 7) * 9;
+        uint64_t t = state[1] << 17;
+        state[2] ^= state[0];
+        state[3] ^= state[1];
+        state[1] ^= state[2];
+        state[0] ^= state[3];
+        state[2] ^= t;
+        state[3] = rotl(state[3], 45);
+        return result;
+    }
+
+    // Return a uniformly random integer in [0, n) without modulo bias (Lemire's multiply-and-reject method).
+    uint32_t bounded(uint32_t n) {
+        uint64_t product = (uint64_t) (uint32_t) ((*this)() >> 32) * n;
+        uint32_t low = (uint32_t) product;
+        if (low < n) {
+            uint32_t threshold = -n % n;
+            while (low < threshold) {
+                product = (uint64_t) (uint32_t) ((*this)() >> 32) * n;
+                low = (uint32_t) product;
+            }
+        }
+        return product >> 32;
+    }
+
+    // Return a uniformly random double in [0, 1).
+    double uniform() {
+        return ((*this)() >> 11) * 0x1.0p-53;
+    }
+
+    void save(BinaryWriter& out) const { out.write(state); }
+    void load(BinaryReader& in) { memcpy(state, in.read<array<uint64_t, 4>>().data(), sizeof(state)); }
+
+    // Fill out with n uniformly random doubles in [0, 1).
+    void fill_uniforms(double* out, int n) {
+        for (int i = 0; i < n; i++) {
+            out[i] = uniform();
+        }
+    }
+
+private:
+    uint64_t state[4];
+
+    static uint64_t rotl(uint64_t x, int k) {
+        return (x << k) | (x >> (64 - k));
+    }
+};
+
+// Metropolis acceptance test that avoids calling exp for every proposal. Improving moves are accepted without 
+// drawing a random number, and a worsening move with cost change delta is accepted iff delta < T * -log(u), 
+// which is equivalent to u < exp(-delta / T). The -log(u) thresholds are generated in batches.
+class MetropolisAcceptor {
+public:
+    bool accept(FastRng& rng, float cost_change, float temperature) {
+        if (cost_change <= 0) {
+            return true;
+        }
+        if (next == batch_size) {
+            refill(rng);
+        }
+        return cost_change < temperature * thresholds[next++];
+    }
+
+    void save(BinaryWriter& out) const {
+        out.write(thresholds);
+        out.write(next);
+    }
+
+    void load(BinaryReader& in) {
+        memcpy(thresholds, in.read<array<double, batch_size>>().data(), sizeof(thresholds));
+        next = in.read<int>();
+    }
+
+private:
+    static constexpr int batch_size = 256;
+    double thresholds[batch_size];
+    int next = batch_size;
+
+    void refill(FastRng& rng) {
+        rng.fill_uniforms(thresholds, batch_size);
+        for (int i = 0; i < batch_size; i++) {
+            // Use 1 - u so that the argument of log is in (0, 1].
+            thresholds[i] = -log(1.0 - thresholds[i]);
+        }
+        next = 0;
+    }
+};
+
+// The cost of a single gap between consecutive games of a team. Gaps are bounded by the length of the schedule, 
+// so the cost curve is normally tabulated once and every evaluation is a table load. For schedules too long to 
+// tabulate, integer exponents fall back to specialised multiplications and anything else to the curve itself.
+class CostModel {
+public:
+    // The largest number of gaps for which the costs are tabulated.
+    static constexpr int max_table_size = 1 << 20;
+
+    // Use the default curve |target_gap - |gap||^exponent.
+    CostModel(float target_gap, float exponent, int max_gap) : target_gap(target_gap), exponent(exponent) {
+        if (max_gap + 1 <= max_table_size) {
+            kind = Kind::Table;
+        } else if (exponent == 2.0) {
+            kind = Kind::Square;
+        } else if (exponent == 3.0) {
+            kind = Kind::Cube;
+        } else if (exponent == 4.0) {
+            kind = Kind::Fourth;
+        } else {
+            kind = Kind::Pow;
+        }
+        if (kind == Kind::Table) {
+            tabulate([&](int gap) { return (float) pow(abs(target_gap - gap), exponent); }, max_gap);
+        }
+    }
+
+    // Use a custom cost curve (which is given the absolute value of the gap).
+    CostModel(function<float(int)> curve, int max_gap) : curve(curve) {
+        if (max_gap + 1 <= max_table_size) {
+            kind = Kind::Table;
+            tabulate(curve, max_gap);
+        } else {
+            kind = Kind::Custom;
+        }
+    }
+
+    float operator()(int gap) const {
+        gap = abs(gap);
+        switch (kind) {
+            case Kind::Table: return table[gap];
+            case Kind::Square: return int_power<2>(abs(target_gap - gap));
+            case Kind::Cube: return int_power<3>(abs(target_gap - gap));
+            case Kind::Fourth: return int_power<4>(abs(target_gap - gap));
+            case Kind::Pow: return pow(abs(target_gap - gap), exponent);
+            default: return curve(gap);
+        }
+    }
+
+    // Write the costs of count (non-negative) gaps to costs, resolving the kind of curve once for the whole array.
+    void costs(const int* gaps, float* costs, int count) const {
+        float target = target_gap;
+        switch (kind) {
+            case Kind::Table: 
+                for (int i = 0; i < count; i++) { costs[i] = table[gaps[i]]; }
+                break;
+            case Kind::Square: 
+                for (int i = 0; i < count; i++) { costs[i] = int_power<2>(abs(target - gaps[i])); }
+                break;
+            case Kind::Cube: 
+                for (int i = 0; i < count; i++) { costs[i] = int_power<3>(abs(target - gaps[i])); }
+                break;
+            case Kind::Fourth: 
+                for (int i = 0; i < count; i++) { costs[i] = int_power<4>(abs(target - gaps[i])); }
+                break;
+            default: 
+                for (int i = 0; i < count; i++) { costs[i] = (*this)(gaps[i]); }
+        }
+    }
+
+    // The total cost of count (non-negative) gaps. The kind of curve is resolved once for the whole array rather 
+    // than once per gap.
+    float sum(const int* gaps, int count) const {
+        float target = target_gap;
+        switch (kind) {
+            case Kind::Table: return sum_lanes(gaps, count, [&](int gap) { return table[gap]; });
+            case Kind::Square: return sum_lanes(gaps, count, [=](int gap) { return int_power<2>(abs(target - gap)); });
+            case Kind::Cube: return sum_lanes(gaps, count, [=](int gap) { return int_power<3>(abs(target - gap)); });
+            case Kind::Fourth: return sum_lanes(gaps, count, [=](int gap) { return int_power<4>(abs(target - gap)); });
+            default: return sum_lanes(gaps, count, [&](int gap) { return (*this)(gap); });
+        }
+    }
+
+private:
+    enum class Kind { Table, Square, Cube, Fourth, Pow, Custom };
+
+    Kind kind;
+    float target_gap = 0.0;
+    float exponent = 0.0;
+    function<float(int)> curve;
+    vector<float> table;
+
+    template <typename Curve>
+    void tabulate(const Curve& cost, int max_gap) {
+        table = vector<float>(max_gap + 1);
+        for (int gap = 0; gap <= max_gap; gap++) {
+            table[gap] = cost(gap);
+        }
+    }
+
+    template <int Exponent>
+    static float int_power(float x) {
+        if constexpr (Exponent == 1) {
+            return x;
+        } else {
+            return x * int_power<Exponent - 1>(x);
+        }
+    }
+
+    // Sum the costs of the gaps in num_lanes independent partial sums, which lets the compiler vectorize the loop 
+    // without reassociating a single floating point sum.
+    template <typename Cost>
+    static float sum_lanes(const int* gaps, int count, const Cost& cost) {
+        constexpr int num_lanes = 8;
+        float lanes[num_lanes] = {};
+        int i = 0;
+        for (; i + num_lanes <= count; i += num_lanes) {
+            for (int lane = 0; lane < num_lanes; lane++) {
+                lanes[lane] += cost(gaps[i + lane]);
+            }
+        }
+        float total = 0.0;
+        for (; i < count; i++) {
+            total += cost(gaps[i]);
+        }
+        for (float lane : lanes) {
+            total += lane;
+        }
+        return total;
+    }
+};
+
+// Full evaluation of a schedule from scratch, independent of the annealer's index, for checking the incrementally 
+// tracked cost and for scoring whole schedules. A single pass over the slots (remembering the last slot of every 
+// team) writes every gap to one flat array, and the costs are then summed over that contiguous array.
+class ScheduleEvaluator {
+public:
+    // Find the gaps of the schedule given by its two sides (teams must be less than num_teams).
+    void load(const vector<TeamId>& home, const vector<TeamId>& away, int num_teams) {
+        last_slots.assign(num_teams, -1);
+        gaps.resize(2 * home.size());
+        int num_gaps = 0;
+        for (int idx = 0; idx < home.size(); idx++) {
+            for (TeamId team : {home[idx], away[idx]}) {
+                // A team's first game has no gap, so its slot is overwritten by the team's next gap.
+                gaps[num_gaps] = idx - last_slots[team];
+                num_gaps += last_slots[team] != -1;
+                last_slots[team] = idx;
+            }
+        }
+        gaps.resize(num_gaps);
+    }
+
+    void load(const Schedule& schedule, int num_teams) { load(schedule.teams[0], schedule.teams[1], num_teams); }
+
+    float cost(const CostModel& cost_model) const { return cost_model.sum(gaps.data(), gaps.size()); }
+
+    // The min, 25th, 50th and 75th percentiles and max of the gaps ("min/25/50/75/max"). Gaps are at most the 
+    // length of the schedule, so the percentiles are read from a histogram instead of sorting the gaps.
+    string gap_distribution() {
+        if (gaps.empty()) {
+            return "0/0/0/0/0";
+        }
+        histogram.assign(*max_element(gaps.begin(), gaps.end()) + 1, 0);
+        for (int gap : gaps) {
+            histogram[gap]++;
+        }
+        // The gaps at these ranks (in sorted order) are reported.
+        array<long, 5> ranks = {0, (long) gaps.size() / 4, (long) gaps.size() / 2, 3 * (long) gaps.size() / 4, 
+                                (long) gaps.size() - 1};
+        array<int, 5> percentiles;
+        long seen = 0;
+        int next = 0;
+        for (int gap = 0; gap < histogram.size() && next < ranks.size(); gap++) {
+            seen += histogram[gap];
+            while (next < ranks.size() && ranks[next] < seen) {
+                percentiles[next++] = gap;
+            }
+        }
+        return to_string(percentiles[0]) + '/' + to_string(percentiles[1]) + '/' + to_string(percentiles[2]) + '/' 
+            + to_string(percentiles[3]) + '/' + to_string(percentiles[4]);
+    }
+
+private:
+    // The gaps of every team, in the order of the later game of each gap.
+    vector<int> gaps;
+    // Scratch space for finding the gaps and for the gap distribution.
+    vector<int> last_slots;
+    vector<long> histogram;
+};
+
+// Instrumentation of the annealing loop is compiled in unless ANNEALER_METRICS is 0, which is the default for 
+// release (NDEBUG) builds. Build with -DANNEALER_METRICS=1 to keep it in an optimised build.
+#ifndef ANNEALER_METRICS
+#ifdef NDEBUG
+#define ANNEALER_METRICS 0
+#else
+#define ANNEALER_METRICS 1
+#endif
+#endif
+
+#if ANNEALER_METRICS
+#define METRIC(statement) statement
+#else
+#define METRIC(statement)
+#endif
+
+// One of a team's games, as seen by the cost terms.
+struct TeamGame {
+    int slot;
+    TeamId opponent;
+    bool home;
+};
+
+// A soft objective that is multiplied by its weight and added to the gap cost. The cost of a term is the sum over 
+// all teams of the cost of each team's sequence of games, and only games that are consecutive or at most reach() 
+// slots apart may interact, so the annealer can evaluate a move from the few games around each changed slot.
+class CostTerm {
+public:
+    explicit CostTerm(float weight) : weight(weight) {}
+    virtual ~CostTerm() = default;
+    virtual const char* name() const = 0;
+    // The cost of a run of consecutive games of the team (ignoring the games outside the run).
+    virtual float sequence_cost(TeamId team, const TeamGame* games, int count) const = 0;
+    // The distance in slots within which games that aren't consecutive can interact.
+    virtual int reach() const { return 0; }
+    float get_weight() const { return weight; }
+
+private:
+    float weight;
+};
+
+// Count the breaks in every team's home/away pattern (consecutive games at home or consecutive games away), so that 
+// home and away games alternate as much as possible.
+class HomeAwayTerm : public CostTerm {
+public:
+    using CostTerm::CostTerm;
+    const char* name() const override { return "home_away"; }
+
+    float sequence_cost(TeamId, const TeamGame* games, int count) const override {
+        int breaks = 0;
+        for (int i = 1; i < count; i++) {
+            breaks += games[i].home == games[i - 1].home;
+        }
+        return breaks;
+    }
+};
+
+// The total distance travelled by every team between the venues of its consecutive games (the venue of a game is 
+// the home team's). The distances between the teams' venues are given as a num_teams x num_teams matrix.
+class TravelTerm : public CostTerm {
+public:
+    TravelTerm(float weight, int num_teams, vector<float> distances) 
+        : CostTerm(weight), num_teams(num_teams), distances(move(distances)) {
+        assert(this->distances.size() == (size_t) num_teams * num_teams);
+    }
+
+    const char* name() const override { return "travel"; }
+
+    float sequence_cost(TeamId team, const TeamGame* games, int count) const override {
+        float distance = 0.0;
+        for (int i = 1; i < count; i++) {
+            distance += distances[venue(team, games[i - 1]) * num_teams + venue(team, games[i])];
+        }
+        return distance;
+    }
+
+private:
+    int num_teams;
+    vector<float> distances;
+
+    static TeamId venue(TeamId team, const TeamGame& game) { return game.home ? team : game.opponent; }
+};
+
+// Penalise rematches of the same two teams that are fewer than min_spacing slots apart, by the number of slots 
+// they are short of min_spacing (counted once for each of the two teams).
+class RematchTerm : public CostTerm {
+public:
+    RematchTerm(float weight, int min_spacing) : CostTerm(weight), min_spacing(min_spacing) {}
+    const char* name() const override { return "rematch"; }
+    int reach() const override { return min_spacing; }
+
+    float sequence_cost(TeamId, const TeamGame* games, int count) const override {
+        float shortfall = 0.0;
+        for (int i = 0; i < count; i++) {
+            for (int j = i + 1; j < count && games[j].slot - games[i].slot < min_spacing; j++) {
+                if (games[j].opponent == games[i].opponent) {
+                    shortfall += min_spacing - (games[j].slot - games[i].slot);
+                }
+            }
+        }
+        return shortfall;
+    }
+
+private:
+    int min_spacing;
+};
+
+// Counters for a stretch of the annealing process.
+struct MetricsCounters {
+    long proposals = 0;
+    long accepts = 0;
+    // Accepted swaps which reduced the cost.
+    long improving_accepts = 0;
+    // Full refreshes of the cost of removing each game.
+    long refreshes = 0;
+    // Proposals rejected because they would break a hard constraint.
+    long infeasible = 0;
+    // Estimated time spent choosing swaps and calculating their cost change, and time spent updating the 
+    // schedule and its bookkeeping after accepted swaps.
+    double delta_seconds = 0.0;
+    double bookkeeping_seconds = 0.0;
+
+    MetricsCounters& operator+=(const MetricsCounters& other) {
+        proposals += other.proposals;
+        accepts += other.accepts;
+        improving_accepts += other.improving_accepts;
+        refreshes += other.refreshes;
+        infeasible += other.infeasible;
+        delta_seconds += other.delta_seconds;
+        bookkeeping_seconds += other.bookkeeping_seconds;
+        return *this;
+    }
+};
+
+// One point of the cost/temperature trace, with the counters accumulated since the previous point.
+struct TraceRecord {
+    float temperature;
+    long iteration;
+    float cost;
+    MetricsCounters counters;
+};
+
+// Metrics collected by an annealer. The counters are only updated in memory while annealing; the trace is 
+// written out on demand.
+class AnnealerMetrics {
+public:
+    using Clock = chrono::steady_clock;
+    // Only one in every timing_period proposals is timed (and the times are scaled up accordingly), since 
+    // reading the clock costs about as much as evaluating a swap.
+    static constexpr long timing_period = 64;
+
+    // Counters since the last trace record.
+    MetricsCounters current;
+
+    // Append a point to the trace and reset the current counters.
+    void record(float temperature, long iteration, float cost) {
+        trace.push_back({temperature, iteration, cost, current});
+        current = MetricsCounters();
+    }
+
+    const vector<TraceRecord>& get_trace() const { return trace; }
+
+    // Sum the counters of the trace records from the given index onwards.
+    MetricsCounters totals_since(int first_record) const {
+        MetricsCounters totals;
+        for (int i = first_record; i < trace.size(); i++) {
+            totals += trace[i].counters;
+        }
+        return totals;
+    }
+
+    void write_csv(ostream& out) const {
+        out << "temperature,iteration,cost,proposals,accepts,improving_accepts,refreshes,infeasible,delta_seconds," 
+            << "bookkeeping_seconds\n";
+        for (const TraceRecord& r : trace) {
+            const MetricsCounters& c = r.counters;
+            out << r.temperature << ',' << r.iteration << ',' << r.cost << ',' << c.proposals << ',' << c.accepts 
+                << ',' << c.improving_accepts << ',' << c.refreshes << ',' << c.infeasible << ',' << c.delta_seconds 
+                << ',' << c.bookkeeping_seconds << '\n';
+        }
+    }
+
+    void write_json(ostream& out) const {
+        out << "[\n";
+        for (int i = 0; i < trace.size(); i++) {
+            const TraceRecord& r = trace[i];
+            const MetricsCounters& c = r.counters;
+            out << "  {\"temperature\": " << r.temperature << ", \"iteration\": " << r.iteration << ", \"cost\": " 
+                << r.cost << ", \"proposals\": " << c.proposals << ", \"accepts\": " << c.accepts 
+                << ", \"improving_accepts\": " << c.improving_accepts << ", \"refreshes\": " << c.refreshes 
+                << ", \"infeasible\": " << c.infeasible << ", \"delta_seconds\": " << c.delta_seconds 
+                << ", \"bookkeeping_seconds\": " << c.bookkeeping_seconds << "}" << (i + 1 < trace.size() ? "," : "") 
+                << '\n';
+        }
+        out << "]\n";
+    }
+
+private:
+    vector<TraceRecord> trace;
+};
+
+// Sampler that draws indices with probability proportional to their weights. The weights are stored in the 
+// leaves of a complete binary sum tree, so a weight can be changed and an index can be drawn in O(log n).
+class WeightedSampler {
+public:
+    void build(const vector<double>& weights) {
+        num_leaves = 1;
+        while (num_leaves < weights.size()) {
+            num_leaves *= 2;
+        }
+        tree = vector<double>(2 * num_leaves, 0.0);
+        copy(weights.begin(), weights.end(), tree.begin() + num_leaves);
+        for (int i = num_leaves - 1; i > 0; i--) {
+            tree[i] = tree[2 * i] + tree[2 * i + 1];
+        }
+    }
+
+    double total() const { return tree[1]; }
+
+    void update(int idx, double weight) {
+        // Every sum on the path to the root is recomputed from its children (rather than adjusted by the 
+        // difference) so that rounding errors don't accumulate over many updates.
+        int i = num_leaves + idx;
+        tree[i] = weight;
+        for (i /= 2; i > 0; i /= 2) {
+            tree[i] = tree[2 * i] + tree[2 * i + 1];
+        }
+    }
+
+    // Return the index whose cumulative weight range contains u * total(), for u in [0, 1).
+    int sample(double u) const {
+        double target = u * tree[1];
+        int i = 1;
+        while (i < num_leaves) {
+            if (target < tree[2 * i] || tree[2 * i + 1] == 0.0) {
+                i = 2 * i;
+            } else {
+                target -= tree[2 * i];
+                i = 2 * i + 1;
+            }
+        }
+        return i - num_leaves;
+    }
+
+private:
+    int num_leaves = 0;
+    vector<double> tree;
+};
+
+// The ways of choosing the games to swap when a swap isn't chosen uniformly at random.
+enum class SwapSampling {
+    // Choose uniformly from the num_worst_games games with the lowest cost of removal.
+    WorstGames,
+    // Choose any game with probability proportional to sampling_weight(cost of removing the game).
+    CostProportional,
+};
+
+// What happened while annealing at one temperature, which cooling schedules use to choose the next temperature.
+struct TemperatureResult {
+    float temperature;
+    long iterations;
+    long num_accepted;
+    // The cost at the end of the temperature and the best cost seen so far.
+    float cost;
+    float best_cost;
+    double seconds;
+};
+
+// Decides the sequence of temperatures (and how long to spend at each one) for ScheduleAnnealer::anneal.
+class CoolingSchedule {
+public:
+    virtual ~CoolingSchedule() = default;
+    virtual float initial_temperature() = 0;
+    // The number of iterations to run at the given temperature.
+    virtual long iterations_at(float temperature) = 0;
+    // Return the temperature to use after the given result, or nullopt to stop annealing.
+    virtual optional<float> next_temperature(const TemperatureResult& result) = 0;
+    // Whether annealing should stop immediately (checked several times per temperature).
+    virtual bool expired() { return false; }
+    // Save and restore any state that the schedule has accumulated (for checkpoints).
+    virtual void save_state(BinaryWriter&) const {}
+    virtual void load_state(BinaryReader&) {}
+};
+
+// Multiply the temperature by a fixed cooling rate until it drops below the minimum temperature.
+class GeometricCooling : public CoolingSchedule {
+public:
+    GeometricCooling(float initial, float minimum, float cooling_rate, long iters_per_temp) 
+        : initial(initial), minimum(minimum), cooling_rate(cooling_rate), iters_per_temp(iters_per_temp) {}
+
+    float initial_temperature() override { return initial; }
+    long iterations_at(float) override { return iters_per_temp; }
+
+    optional<float> next_temperature(const TemperatureResult& result) override {
+        float next = result.temperature * cooling_rate;
+        if (next <= minimum) {
+            return nullopt;
+        }
+        return next;
+    }
+
+private:
+    float initial;
+    float minimum;
+    float cooling_rate;
+    long iters_per_temp;
+};
+
+// Follow the same temperatures as GeometricCooling, but fit the whole schedule into a wall-clock budget. The 
+// proposal rate is measured on a short calibration run at the first temperature, and the iterations per 
+// temperature are recomputed after every temperature from the measured rate and the time that is left.
+class TimeBudgetCooling : public CoolingSchedule {
+public:
+    using Clock = chrono::steady_clock;
+
+    TimeBudgetCooling(float initial, float minimum, float cooling_rate, double budget_seconds) 
+        : initial(initial), minimum(minimum), cooling_rate(cooling_rate), seconds_left(budget_seconds) {
+        num_temperatures = max(1, (int) ceil(log(minimum / initial) / log(cooling_rate)));
+    }
+
+    // The anneal starts here, and so does the budget.
+    float initial_temperature() override {
+        get_deadline();
+        return initial;
+    }
+
+    long iterations_at(float) override {
+        return iters_per_temp;
+    }
+
+    optional<float> next_temperature(const TemperatureResult& result) override {
+        total_iterations += result.iterations;
+        total_seconds += result.seconds;
+        if (!calibrated) {
+            // The calibration run counts as part of the first temperature.
+            calibrated = true;
+            temperatures_left = num_temperatures;
+        } else {
+            temperatures_left--;
+        }
+        if (expired() || temperatures_left <= 0) {
+            return nullopt;
+        }
+
+        double rate = total_iterations / max(total_seconds, 1e-9);
+        double remaining = chrono::duration<double>(get_deadline() - Clock::now()).count();
+        iters_per_temp = max(1L, (long) (rate * remaining / temperatures_left));
+        // The first temperature continues after calibration.
+        if (temperatures_left == num_temperatures) {
+            return result.temperature;
+        }
+        return result.temperature * cooling_rate;
+    }
+
+    bool expired() override { return Clock::now() >= get_deadline(); }
+
+    // The budget that was left when the checkpoint was taken, which starts running again once the resumed anneal 
+    // does.
+    void save_state(BinaryWriter& out) const override {
+        out.write(deadline ? chrono::duration<double>(*deadline - Clock::now()).count() : seconds_left);
+        out.write(temperatures_left);
+        out.write(calibrated);
+        out.write(iters_per_temp);
+        out.write(total_iterations);
+        out.write(total_seconds);
+    }
+
+    void load_state(BinaryReader& in) override {
+        seconds_left = in.read<double>();
+        deadline = nullopt;
+        temperatures_left = in.read<int>();
+        calibrated = in.read<bool>();
+        iters_per_temp = in.read<long>();
+        total_iterations = in.read<long>();
+        total_seconds = in.read<double>();
+    }
+
+private:
+    float initial;
+    float minimum;
+    float cooling_rate;
+    // The budget left when the clock was last stopped, and the deadline once the anneal has started (the clock 
+    // starts at the first call from the anneal, so setup and loading before it don't use up the budget).
+    double seconds_left;
+    optional<Clock::time_point> deadline;
+    int num_temperatures;
+    int temperatures_left = 0;
+    bool calibrated = false;
+    long iters_per_temp = 10000;
+    long total_iterations = 0;
+    double total_seconds = 0.0;
+
+    Clock::time_point get_deadline() {
+        if (!deadline) {
+            deadline = Clock::now() + chrono::duration_cast<Clock::duration>(chrono::duration<double>(seconds_left));
+        }
+        return *deadline;
+    }
+};
+
+// Cool faster while the acceptance rate is above the target band and slower while it is below it, and reheat 
+// when the best cost stops improving for a while.
+class AdaptiveCooling : public CoolingSchedule {
+public:
+    struct Parameters {
+        float initial_temperature = 1000.0;
+        float min_temperature = 10.0;
+        long iters_per_temp = 100000;
+        // The target band for the acceptance rate.
+        float min_acceptance = 0.02;
+        float max_acceptance = 0.2;
+        // The cooling rates used below, within and above the target band.
+        float slow_cooling_rate = 0.9;
+        float cooling_rate = 0.7;
+        float fast_cooling_rate = 0.3;
+        // Reheat (multiply the temperature by reheat_factor) after this many temperatures without a new best 
+        // cost, at most max_reheats times.
+        int stagnation_temperatures = 3;
+        float reheat_factor = 4.0;
+        int max_reheats = 3;
+    };
+
+    explicit AdaptiveCooling(const Parameters& params) : params(params) {}
+
+    float initial_temperature() override { return params.initial_temperature; }
+    long iterations_at(float) override { return params.iters_per_temp; }
+
+    optional<float> next_temperature(const TemperatureResult& result) override {
+        if (result.best_cost < best_cost) {
+            best_cost = result.best_cost;
+            temperatures_without_improvement = 0;
+        } else {
+            temperatures_without_improvement++;
+        }
+        if (temperatures_without_improvement >= params.stagnation_temperatures && num_reheats < params.max_reheats) {
+            num_reheats++;
+            temperatures_without_improvement = 0;
+            return min(params.initial_temperature, result.temperature * params.reheat_factor);
+        }
+
+        float acceptance = (float) result.num_accepted / max(1L, result.iterations);
+        float rate = params.cooling_rate;
+        if (acceptance > params.max_acceptance) {
+            rate = params.fast_cooling_rate;
+        } else if (acceptance < params.min_acceptance) {
+            rate = params.slow_cooling_rate;
+        }
+        float next = result.temperature * rate;
+        if (next <= params.min_temperature) {
+            return nullopt;
+        }
+        return next;
+    }
+
+    void save_state(BinaryWriter& out) const override {
+        out.write(best_cost);
+        out.write(temperatures_without_improvement);
+        out.write(num_reheats);
+    }
+
+    void load_state(BinaryReader& in) override {
+        best_cost = in.read<float>();
+        temperatures_without_improvement = in.read<int>();
+        num_reheats = in.read<int>();
+    }
+
+private:
+    Parameters params;
+    float best_cost = numeric_limits<float>::infinity();
+    int temperatures_without_improvement = 0;
+    int num_reheats = 0;
+};
+
+// The built-in cooling schedules.
+enum class Cooling {
+    Geometric,
+    TimeBudget,
+    Adaptive,
+};
+
+// Writes checkpoints on a background thread so that the annealer only pays for copying its state into a buffer. 
+// If a new checkpoint arrives before the previous one has been written, only the newest is kept. Every checkpoint 
+// is written to a temporary file which then replaces the previous checkpoint, so a crash never leaves a partial 
+// checkpoint behind.
+class CheckpointWriter {
+public:
+    explicit CheckpointWriter(string path) : path(move(path)), writer([this]() { write_loop(); }) {}
+
+    ~CheckpointWriter() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        changed.notify_all();
+        writer.join();
+    }
+
+    void submit(string checkpoint) {
+        {
+            lock_guard<mutex> guard(lock);
+            pending = move(checkpoint);
+            has_pending = true;
+        }
+        changed.notify_all();
+    }
+
+    // Wait until every submitted checkpoint has been written.
+    void flush() {
+        unique_lock<mutex> guard(lock);
+        changed.wait(guard, [this]() { return !has_pending && !writing; });
+    }
+
+private:
+    string path;
+    mutex lock;
+    condition_variable changed;
+    string pending;
+    bool has_pending = false;
+    bool writing = false;
+    bool stopping = false;
+    thread writer;
+
+    void write_loop() {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            changed.wait(guard, [this]() { return has_pending || stopping; });
+            if (!has_pending) {
+                return;
+            }
+            string checkpoint = move(pending);
+            has_pending = false;
+            writing = true;
+            guard.unlock();
+            string temp_path = path + ".tmp";
+            {
+                ofstream out(temp_path, ios::binary);
+                out.write(checkpoint.data(), checkpoint.size());
+            }
+            if (rename(temp_path.c_str(), path.c_str()) != 0) {
+                cerr << "Unable to write checkpoint " << path << endl;
+            }
+            guard.lock();
+            writing = false;
+            changed.notify_all();
+        }
+    }
+};
+
+// Parameters controlling the annealing process.
+struct AnnealerConfig {
+    // Control how much to punish large deviations from the target number of games played. Specifically, the 
+    // deviation from the target number of games played is raised to the deviation_exponent power. e.g. for 
+    // deviation_exponent = 2.0, the cost of a given schedule is the total squared deviation from the target
+    // games played.
+    float deviation_exponent = 3.0;
+    // A custom cost for a gap of the given (absolute) length between consecutive games of a team. If set, it 
+    // replaces the default deviation-based cost.
+    function<float(int)> cost_curve;
+    // Initial temperature for the simulated annealing algorithm.
+    float initial_temperature = 1000.0;
+    // Number of iterations per temperature.
+    int iters_per_temp = 500000;
+    // Cooling rate for the simulated annealing algorithm.
+    float cooling_rate = 0.3;
+    // Temperature at which the annealing process stops.
+    float min_temperature = 10.0;
+    // The cooling schedule used by anneal (the parameters above describe the geometric schedule, which the 
+    // other schedules use as a starting point).
+    Cooling cooling = Cooling::Geometric;
+    // The wall-clock budget for the time budget schedule.
+    double time_budget_seconds = 2.0;
+    // Parameters for the adaptive schedule (the temperatures and iters_per_temp above are copied into them).
+    AdaptiveCooling::Parameters adaptive_cooling;
+    // Stop early if the best cost improves by less than stall_tolerance (relative) over stall_temperatures 
+    // consecutive temperatures (0 disables early stopping).
+    int stall_temperatures = 0;
+    float stall_tolerance = 1e-3;
+    // The probability of choosing a swap between two uniformly random games (otherwise, the games are chosen 
+    // using swap_sampling).
+    float random_swap_prob = 1.0 / 3.0;
+    // How to choose the games to swap when the swap isn't uniformly random.
+    SwapSampling swap_sampling = SwapSampling::CostProportional;
+    // Whether to cache the cost changes of swaps (see SwapDeltaCache) in 2^delta_cache_log2 entries, so that swaps 
+    // proposed again before any of their teams' games move aren't evaluated again. Cached changes don't include 
+    // the changes of the extra cost terms, so the cache is only used without them. Any other kind of move shifts 
+    // the games of many teams and invalidates most entries (leaving hit rates of a few percent), so the cache is 
+    // also only used when swaps are the only moves.
+    bool cache_swap_deltas = true;
+    int delta_cache_log2 = 13;
+    // The weight given to a game when sampling proportionally to the cost of removing it. By default, games 
+    // whose removal is beneficial are weighted by that benefit and all other games get a weight of 1.
+    function<double(float)> sampling_weight = [](float cost) { return max(0.0, -(double) cost) + 1.0; };
+    // The number of games to include in the set of all possible swaps (by choosing the n games that have 
+    // the highest benefit when removed).
+    int num_worst_games = 128;
+    // The refresh rate for the set of n worst games (the set of n worst games is refreshed after k * n^2 
+    // iterations of the annealer). So, a lower value of refresh_freq will keep n_worst_games more fresh at 
+    // the cost of extra computation time.
+    float refresh_freq = 0.01;
+    // Whether to update the cost of removing each game (and the structures used to sample games) after every 
+    // accepted swap (only the swapped games and their neighbours are affected) instead of periodically 
+    // refreshing them.
+    bool incremental_refresh = true;
+    // The initial relative weights of the kinds of moves: swapping two games, moving a game to another slot 
+    // (shifting the games in between), reversing the order of a range of slots and relabelling two teams. A kind 
+    // of move with weight 0 is never made. Relabelling never changes any gaps, so it is disabled by default.
+    float swap_weight = 1.0;
+    float insertion_weight = 0.5;
+    float reversal_weight = 0.5;
+    float relabel_weight = 0.0;
+    // The initial relative weight of multiple-try swaps (see ScheduleAnnealer::MultiTrySwapMove), which evaluate 
+    // multi_try_candidates uniformly random swaps at once and choose among them. They pay off at low temperatures, 
+    // where almost every single proposal is rejected, so they are disabled by default.
+    float multi_try_weight = 0.0;
+    int multi_try_candidates = 8;
+    // The maximum distance that an insertion moves a game and the maximum length of a reversed range (0 uses the 
+    // number of teams, which is twice the target gap, up to 32 so that range moves stay cheap in large leagues).
+    int max_move_span = 0;
+    // Whether to learn the probability of each kind of move from how much its accepted proposals improve the cost. 
+    // The probabilities are updated every move_weight_period iterations and never drop below min_move_probability.
+    bool adaptive_move_weights = true;
+    int move_weight_period = 20000;
+    float min_move_probability = 0.05;
+    // Hard constraints that no accepted move may break (see HardConstraints): consecutive games of a team must be 
+    // more than rest_slots slots apart, a team plays at most once in every round of round_length slots, and a team 
+    // never plays in a slot blacked out for it. Each rule is disabled by 0 or an empty list.
+    int rest_slots = 0;
+    int round_length = 0;
+    vector<pair<TeamId, int>> blackouts;
+    // Extra soft objectives (such as HomeAwayTerm, TravelTerm and RematchTerm), each multiplied by its weight and 
+    // added to the gap cost. Copies of the config share the terms, so terms must not hold any mutable state.
+    vector<shared_ptr<const CostTerm>> cost_terms;
+    // Whether anneal recomputes every cost term from scratch after every tenth of a temperature and throws if the 
+    // incrementally tracked costs have drifted from them (for checking the incremental cost changes).
+    bool verify_costs = false;
+    // Whether anneal replaces the tracked costs with a full recomputation after every temperature, which removes 
+    // the rounding errors accumulated by adding up millions of cost changes.
+    bool correct_drift = true;
+    // Re-optimising after an edit (see ScheduleAnnealer::reoptimize): only the slots within local_radius of the 
+    // edit (0 uses a quarter of the number of teams, half the target gap) are annealed, for local_iters iterations 
+    // cooling geometrically from local_temperature to a tenth of it, while every other game stays where it is. 
+    // Most moves in the window improve the cost a little, so the radius is what bounds how many games move.
+    int local_radius = 0;
+    float local_temperature = 2.0;
+    int local_iters = 20000;
+    // If set, anneal periodically saves its complete state to this file so that it can be resumed with 
+    // load_checkpoint (using the same config).
+    string checkpoint_path;
+    // The number of iterations between checkpoints.
+    long checkpoint_every = 1000000;
+    // Whether anneal prints its progress.
+    bool verbose = true;
+    // Seed for the annealer's random number generator.
+    uint64_t seed = 1;
+};
+
+// Implement simulated annealing algorithm to optimize schedule.
+class ScheduleAnnealer {
+public:
+    ScheduleAnnealer(Schedule& schedule, int num_teams, const AnnealerConfig& config = AnnealerConfig()) 
+        : schedule(schedule), num_teams(num_teams), schedule_length(schedule.size()), config(config), 
+          cost_model(make_cost_model()), rng(config.seed) {
+        setup_annealer();
+        setup_moves();
+    }
+
+    // Restart the annealer's random number sequence from the given seed.
+    void set_seed(uint64_t seed) {
+        rng.set_seed(seed);
+        acceptor = MetropolisAcceptor();
+    }
+
+    void anneal() {
+        // Progress is only printed in verbose mode.
+        ostream log(config.verbose ? cout.rdbuf() : nullptr);
+        log << "Initial Cost: " << calculate_total_cost() << '\n';
+        log << "Initial Gap Distribution: " << calculate_gap_dist() << " (min/25/50/75/max)" << '\n';
+        if (constraints.active()) {
+            log << "Initial Hard Constraint Violations: " << constraints.count_violations(team_to_games) << '\n';
+        }
+        
+        cooling = cooling_schedule ? move(cooling_schedule) : make_cooling_schedule();
+        if (resuming) {
+            // Continue from the point at which the checkpoint was taken.
+            BinaryReader in(resumed_cooling_state);
+            cooling->load_state(in);
+            resuming = false;
+        } else {
+            record_best();
+            float temperature = cooling->initial_temperature();
+            progress = {temperature, cooling->iterations_at(temperature), 0, 0, 0, best_cost, 0};
+        }
+        last_checkpoint_iteration = progress.iteration;
+        
+        while (true) {
+            float temperature = progress.temperature;
+            // The trace gets a point every tenth of a temperature, and progress is printed once per temperature.
+            long iters_per_record = max(1L, progress.iters / 10);
+            auto start = chrono::steady_clock::now();
+            long cache_hits = delta_cache.get_hits();
+            long cache_lookups = cache_hits + delta_cache.get_misses();
+            METRIC(int first_record = metrics.get_trace().size());
+            while (progress.num_run < progress.iters && !cooling->expired()) {
+                long chunk = min(iters_per_record, progress.iters - progress.num_run);
+                progress.num_accepted += run_iterations(temperature, chunk);
+                progress.num_run += chunk;
+                progress.iteration += chunk;
+                if (config.verify_costs) {
+                    verify_costs();
+                }
+                METRIC(metrics.record(temperature, progress.iteration, cum_cost));
+                if (!config.checkpoint_path.empty() 
+                    && progress.iteration - last_checkpoint_iteration >= config.checkpoint_every) {
+                    save_checkpoint();
+                }
+            }
+            float drift = config.correct_drift ? correct_cost_drift() : 0.0;
+            record_best();
+
+            log << "Temperature " << temperature << ": Acceptance Rate = " 
+                << (float) progress.num_accepted / max(1L, progress.num_run) << ", Cost = " << cum_cost;
+            if (config.correct_drift) {
+                log << ", Drift = " << drift;
+            }
+            if (use_delta_cache) {
+                log << ", Delta Cache Hit Rate = " << (float) (delta_cache.get_hits() - cache_hits) 
+                    / max(1L, delta_cache.get_hits() + delta_cache.get_misses() - cache_lookups);
+            }
+            METRIC(
+                MetricsCounters totals = metrics.totals_since(first_record);
+                log << ", Improving Accepts = " << totals.improving_accepts << ", Refreshes = " << totals.refreshes 
+                    << ", Delta Time = " << totals.delta_seconds << "s, Bookkeeping Time = " 
+                    << totals.bookkeeping_seconds << "s";
+                if (constraints.active()) {
+                    log << ", Infeasible = " << totals.infeasible;
+                }
+            )
+            log << '\n';
+            
+            // Stop early if the best cost has stalled for stall_temperatures temperatures.
+            if (config.stall_temperatures > 0) {
+                if (best_cost < progress.stall_reference_cost * (1 - config.stall_tolerance)) {
+                    progress.stall_reference_cost = best_cost;
+                    progress.num_stalled_temperatures = 0;
+                } else if (++progress.num_stalled_temperatures >= config.stall_temperatures) {
+                    log << "Stopping early after " << progress.num_stalled_temperatures 
+                        << " temperatures without improvement\n";
+                    break;
+                }
+            }
+            if (cooling->expired()) {
+                break;
+            }
+            
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            optional<float> next = cooling->next_temperature(
+                {temperature, progress.num_run, progress.num_accepted, cum_cost, best_cost, seconds});
+            if (!next) {
+                break;
+            }
+            progress.temperature = *next;
+            progress.iters = cooling->iterations_at(*next);
+            progress.num_run = 0;
+            progress.num_accepted = 0;
+        }
+        if (checkpoint_writer) {
+            checkpoint_writer->flush();
+        }
+        
+        // Finish with the best schedule found, which may not be the current one if the schedule was reheated.
+        if (best_cost < cum_cost) {
+            restore_best();
+        }
+        log << "Final Cost: " << calculate_total_cost() << '\n';
+        if (!config.cost_terms.empty()) {
+            log << "Final Cost Terms: " << describe_cost_terms() << '\n';
+        }
+        log << "Final Gap Distribution: " << calculate_gap_dist() << " (min/25/50/75/max)" << '\n';
+        if (constraints.active()) {
+            log << "Final Hard Constraint Violations: " << constraints.count_violations(team_to_games) << '\n';
+        }
+        if (use_delta_cache) {
+            log << "Delta Cache (hits/lookups): " << delta_cache.get_hits() << "/" 
+                << delta_cache.get_hits() + delta_cache.get_misses() << '\n';
+        }
+        log << "Moves (accepted/proposed): " << describe_moves() << endl;
+    }
+
+    // Restore the state saved in a checkpoint (written while annealing with checkpoint_path set), so that the next 
+    // call to anneal continues exactly where the checkpointed run was. The annealer must use the same config as 
+    // the checkpointed run, and the schedule it was constructed with is replaced by the checkpointed one.
+    void load_checkpoint(const string& path) {
+        ifstream file(path, ios::binary);
+        if (!file) {
+            throw runtime_error("Unable to open " + path);
+        }
+        string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+        BinaryReader in(data);
+        if (in.read<array<char, 4>>() != checkpoint_magic || in.read<uint32_t>() != checkpoint_version) {
+            throw runtime_error(path + " is not a checkpoint");
+        }
+
+        // Everything is read and checked against the loaded schedule before any of it is installed, so a 
+        // checkpoint that doesn't fit leaves the annealer as it was.
+        Schedule loaded;
+        uint64_t num_names = in.read<uint64_t>();
+        for (uint64_t i = 0; i < num_names; i++) {
+            loaded.intern_team(in.read_string());
+        }
+        loaded.teams[0] = in.read_vector<TeamId>();
+        loaded.teams[1] = in.read_vector<TeamId>();
+        int length = loaded.size();
+        if (loaded.num_teams() != schedule.num_teams() || in.read<int>() != num_teams) {
+            throw runtime_error(path + " was written with a different number of teams");
+        }
+        // Whether the arrays are a schedule of the loaded length over the loaded teams.
+        auto is_schedule = [&](const vector<TeamId>& home, const vector<TeamId>& away) {
+            auto known = [&](TeamId team) { return team < loaded.num_teams(); };
+            return home.size() == length && away.size() == length && all_of(home.begin(), home.end(), known) 
+                && all_of(away.begin(), away.end(), known);
+        };
+        if (!is_schedule(loaded.teams[0], loaded.teams[1])) {
+            throw runtime_error(path + " holds a malformed schedule");
+        }
+
+        float loaded_cost = in.read<float>();
+        vector<double> loaded_term_totals = in.read_vector<double>();
+        if (loaded_term_totals.size() != config.cost_terms.size()) {
+            throw runtime_error(path + " was written with different cost terms");
+        }
+        float loaded_best_cost = in.read<float>();
+        vector<TeamId> loaded_best_teams[2] = {in.read_vector<TeamId>(), in.read_vector<TeamId>()};
+        if (!is_schedule(loaded_best_teams[0], loaded_best_teams[1])) {
+            throw runtime_error(path + " holds a malformed best schedule");
+        }
+        FastRng loaded_rng = rng;
+        loaded_rng.load(in);
+        MetropolisAcceptor loaded_acceptor = acceptor;
+        loaded_acceptor.load(in);
+        int loaded_iters_since_refresh = in.read<int>();
+        vector<float> loaded_move_probabilities = in.read_vector<float>();
+        vector<MoveStats> loaded_move_stats = in.read_vector<MoveStats>();
+        vector<MoveStats> loaded_move_stats_at_update = in.read_vector<MoveStats>();
+        int loaded_iters_since_move_update = in.read<int>();
+        if (loaded_move_probabilities.size() != moves.size() || loaded_move_stats.size() != moves.size() 
+            || loaded_move_stats_at_update.size() != moves.size()) {
+            throw runtime_error(path + " was written with different move weights");
+        }
+        vector<float> loaded_removal_costs = in.read_vector<float>();
+        if (loaded_removal_costs.size() != length) {
+            throw runtime_error(path + " has removal costs for " + to_string(loaded_removal_costs.size()) 
+                                + " games instead of " + to_string(length));
+        }
+        WorstGamesPool loaded_worst_games;
+        if (config.swap_sampling == SwapSampling::WorstGames) {
+            try {
+                loaded_worst_games.load(in, length);
+            } catch (const runtime_error& e) {
+                throw runtime_error(path + ": " + e.what());
+            }
+        }
+        AnnealProgress loaded_progress = in.read<AnnealProgress>();
+        string cooling_state = in.read_string();
+
+        schedule = loaded;
+        schedule_length = length;
+        cost_model = make_cost_model();
+        team_to_games.build(schedule);
+        constraints.build(schedule, config.rest_slots, config.round_length, config.blackouts);
+        delta_cache.reset(team_to_games.num_teams(), use_delta_cache ? config.delta_cache_log2 : 0);
+        cum_cost = loaded_cost;
+        term_totals = loaded_term_totals;
+        term_changes.assign(term_totals.size(), 0.0);
+        best_cost = loaded_best_cost;
+        best_teams[0] = move(loaded_best_teams[0]);
+        best_teams[1] = move(loaded_best_teams[1]);
+        rng = loaded_rng;
+        acceptor = loaded_acceptor;
+        iters_since_refresh = loaded_iters_since_refresh;
+        move_probabilities = loaded_move_probabilities;
+        move_stats = loaded_move_stats;
+        move_stats_at_update = loaded_move_stats_at_update;
+        iters_since_move_update = loaded_iters_since_move_update;
+        cost_of_removing_game = loaded_removal_costs;
+        if (config.swap_sampling == SwapSampling::WorstGames) {
+            worst_games = move(loaded_worst_games);
+        } else {
+            rebuild_game_sampler();
+        }
+        progress = loaded_progress;
+        resumed_cooling_state = cooling_state;
+        resuming = true;
+    }
+
+    // Use the given cooling schedule for the next call to anneal instead of the one described by the config.
+    void set_cooling_schedule(unique_ptr<CoolingSchedule> schedule) {
+        cooling_schedule = move(schedule);
+    }
+
+    // Run num_iters iterations of the annealer at a fixed temperature and return the number of accepted swaps.
+    int run_iterations(float temperature, int num_iters) {
+        int num_accepted = 0;
+        run_temperature = temperature;
+        for (int iter = 0; iter < num_iters; iter++) {
+            METRIC(
+                using Clock = AnnealerMetrics::Clock;
+                bool timed = metrics.current.proposals++ % AnnealerMetrics::timing_period == 0;
+                Clock::time_point start = timed ? Clock::now() : Clock::time_point();
+            )
+            int move_type = choose_move_type();
+            Move& move = *moves[move_type];
+            MoveStats& stats = move_stats[move_type];
+            stats.proposals++;
+            if (config.adaptive_move_weights && ++iters_since_move_update >= config.move_weight_period) {
+                update_move_probabilities();
+            }
+            if (!move.propose()) {
+                continue;
+            }
+            float cost_change = move.delta();
+            METRIC(metrics.current.infeasible += isinf(cost_change));
+            METRIC(
+                Clock::time_point evaluated = timed ? Clock::now() : Clock::time_point();
+                if (timed) {
+                    metrics.current.delta_seconds += chrono::duration<double>(evaluated - start).count() 
+                        * AnnealerMetrics::timing_period;
+                }
+            )
+            if (acceptor.accept(rng, move.acceptance_change(cost_change), temperature)) {
+                num_accepted++;
+                stats.accepted++;
+                stats.improvement += max(0.0f, -cost_change);
+                cum_cost += cost_change;
+                for (int i = 0; i < term_totals.size(); i++) {
+                    term_totals[i] += term_changes[i];
+                }
+                move.apply();
+                METRIC(
+                    metrics.current.accepts++;
+                    metrics.current.improving_accepts += cost_change < 0;
+                    if (timed) {
+                        metrics.current.bookkeeping_seconds += 
+                            chrono::duration<double>(Clock::now() - evaluated).count() * AnnealerMetrics::timing_period;
+                    }
+                )
+            }
+            
+            // Refresh the set of worst games after (refresh_freq * num_worst_games^2) iterations (unless it 
+            // is being kept up to date after every swap).
+            if (!config.incremental_refresh && ++iters_since_refresh >= (int) (config.refresh_freq * pow(config.num_worst_games, 2))) {
+                refresh_worst_games();
+                iters_since_refresh = 0;
+            }
+        }
+        return num_accepted;
+    }
+
+    // The metrics collected so far (empty unless ANNEALER_METRICS is enabled).
+    AnnealerMetrics& get_metrics() { return metrics; }
+
+    // The cost of the current schedule (tracked incrementally as swaps are accepted).
+    float get_cost() const { return cum_cost; }
+
+    // The number of hard constraint violations in the current schedule (0 without constraints).
+    int count_violations() const { return constraints.active() ? constraints.count_violations(team_to_games) : 0; }
+
+    // Remember the current schedule if it is the best one seen so far.
+    void record_best() {
+        if (cum_cost < best_cost) {
+            best_cost = cum_cost;
+            best_teams[0] = schedule.teams[0];
+            best_teams[1] = schedule.teams[1];
+        }
+    }
+
+    float get_best_cost() const { return best_cost; }
+
+    // Replace the current schedule with the best one recorded by record_best.
+    void restore_best() {
+        schedule.teams[0] = best_teams[0];
+        schedule.teams[1] = best_teams[1];
+        setup_annealer();
+    }
+
+    // Replace the current schedule with another arrangement of the same teams and length (such as one migrated from 
+    // another annealer) and rebuild the index, the hard constraints and the sampled games from it.
+    void adopt_schedule(const vector<TeamId>& home, const vector<TeamId>& away) {
+        assert(home.size() == schedule_length && away.size() == schedule_length);
+        schedule.teams[0] = home;
+        schedule.teams[1] = away;
+        setup_annealer();
+        record_best();
+    }
+
+    // Return a copy of the schedule with the best schedule recorded by record_best.
+    Schedule get_best_schedule() const {
+        Schedule best = schedule;
+        best.teams[0] = best_teams[0];
+        best.teams[1] = best_teams[1];
+        return best;
+    }
+
+    /*========================= 
+        Schedule Edits
+      =========================*/
+    // Insert a game between team1 and team2 (which must both already play in the schedule) at slot idx, moving 
+    // every later game one slot later. The index and the gap cost are updated in place. Pins and blackouts after 
+    // idx move with their slots.
+    void insert_game(TeamId team1, TeamId team2, int idx) {
+        int num_indexed = team_to_games.num_teams();
+        if (team1 == team2 || team1 >= num_indexed || team2 >= num_indexed || idx < 0 || idx > schedule_length) {
+            throw invalid_argument("Invalid game to insert at slot " + to_string(idx));
+        }
+        // Every team's gap across idx grows by one slot, except that the gaps of the new game's teams are split 
+        // by the new game.
+        float gap_change = 0.0;
+        for (int team = 0; team < num_indexed; team++) {
+            auto [lower, upper] = team_to_games.neighbors_around(team, idx, -1);
+            int shifted_upper = upper == -1 ? -1 : upper + 1;
+            if (team == team1 || team == team2) {
+                gap_change += gap_cost(lower, idx) + gap_cost(idx, shifted_upper) - gap_cost(lower, upper);
+            } else {
+                gap_change += gap_cost(lower, shifted_upper) - gap_cost(lower, upper);
+            }
+        }
+        schedule.teams[0].insert(schedule.teams[0].begin() + idx, team1);
+        schedule.teams[1].insert(schedule.teams[1].begin() + idx, team2);
+        schedule_length++;
+        team_to_games.insert_slot(idx, team1, team2);
+        shift_slot_references(idx, 1);
+        cum_cost += gap_change;
+        refresh_after_edit();
+    }
+
+    // Remove the game at slot idx (and its pin), moving every later game one slot earlier. Blackouts of the 
+    // removed slot are dropped.
+    void remove_game(int idx) {
+        if (idx < 0 || idx >= schedule_length || schedule_length < 2) {
+            throw invalid_argument("Invalid game to remove at slot " + to_string(idx));
+        }
+        // Every team's gap across idx shrinks by one slot, and the two gaps of each of the removed game's teams 
+        // around it are merged.
+        float gap_change = 0.0;
+        for (int team = 0; team < team_to_games.num_teams(); team++) {
+            if (plays_at(team, idx)) {
+                int side = team_to_games.team_at(idx, 0) == team ? 0 : 1;
+                auto [lower, upper] = team_to_games.neighbors(team, team_to_games.position_at(idx, side));
+                int shifted_upper = upper == -1 ? -1 : upper - 1;
+                gap_change += gap_cost(lower, shifted_upper) - gap_cost(lower, idx) - gap_cost(idx, upper);
+            } else {
+                auto [lower, upper] = team_to_games.neighbors_around(team, idx, -1);
+                int shifted_upper = upper == -1 ? -1 : upper - 1;
+                gap_change += gap_cost(lower, shifted_upper) - gap_cost(lower, upper);
+            }
+        }
+        unpin_game(idx);
+        schedule.teams[0].erase(schedule.teams[0].begin() + idx);
+        schedule.teams[1].erase(schedule.teams[1].begin() + idx);
+        schedule_length--;
+        team_to_games.remove_slot(idx);
+        shift_slot_references(idx, -1);
+        cum_cost += gap_change;
+        refresh_after_edit();
+    }
+
+    // Keep the game at slot idx where it is: no move changes the slot or the teams of a pinned game.
+    void pin_game(int idx) {
+        auto it = lower_bound(pinned_slots.begin(), pinned_slots.end(), idx);
+        if (it == pinned_slots.end() || *it != idx) {
+            pinned_slots.insert(it, idx);
+            delta_cache.clear();
+        }
+    }
+
+    void unpin_game(int idx) {
+        auto it = lower_bound(pinned_slots.begin(), pinned_slots.end(), idx);
+        if (it != pinned_slots.end() && *it == idx) {
+            pinned_slots.erase(it);
+            delta_cache.clear();
+        }
+    }
+
+    // Anneal only the slots in [lo, hi] at a low temperature (see AnnealerConfig::local_iters), with every other 
+    // game frozen, and finish with the best schedule found. Returns the change in cost.
+    float reoptimize(int lo, int hi) {
+        lo = max(lo, 0);
+        hi = min(hi, schedule_length - 1);
+        float start_cost = cum_cost;
+        if (hi <= lo) {
+            return 0.0;
+        }
+        // The best schedule starts again from the current one, so that the result never undoes an edit or a pin.
+        reset_best();
+        window_lo = lo;
+        window_hi = hi;
+        const int num_stages = 4;
+        for (int stage = 0; stage < num_stages; stage++) {
+            float temperature = config.local_temperature * pow(0.1, stage / (num_stages - 1.0));
+            run_iterations(temperature, max(1, config.local_iters / num_stages));
+            record_best();
+        }
+        window_lo = 0;
+        window_hi = -1;
+        if (best_cost < cum_cost) {
+            restore_best();
+        }
+        return cum_cost - start_cost;
+    }
+
+    // The slots [lo, hi] that are re-optimised after an edit at slot idx.
+    pair<int, int> local_window(int idx) const {
+        int radius = config.local_radius > 0 ? config.local_radius : max(2, num_teams / 4);
+        return {max(idx - radius, 0), min(idx + radius, schedule_length - 1)};
+    }
+
+    // Re-optimise the slots within config.local_radius of the edited slot idx.
+    float reoptimize_around(int idx) {
+        auto [lo, hi] = local_window(idx);
+        return reoptimize(lo, hi);
+    }
+
+private:
+    friend class ScheduleBenchmark;
+
+    /*=========================
+        Schedule Data
+      =========================*/
+    Schedule& schedule;
+    int num_teams;
+    int schedule_length;
+
+    /*=========================
+        Annealing Parameters
+      =========================*/
+    AnnealerConfig config;
+
+    /*=========================
+        Pre-Processing Data
+      =========================*/
+    // The cost of each possible gap between games.
+    CostModel cost_model;
+    // Scratch space for evaluating the whole schedule from scratch.
+    ScheduleEvaluator evaluator;
+    // The cost changes of recently evaluated swaps (only used if use_delta_cache is set).
+    SwapDeltaCache delta_cache;
+    bool use_delta_cache = false;
+    // Scratch space for evaluating many swaps at once, as structures of arrays over the teams the swaps move: each 
+    // team's games, the slot it moves from and to, its position in its games, the rank of the destination among 
+    // them and whether it moves at all (1 or 0); then the 6 gaps every team removes or creates, their weights in 
+    // the change (-1 or 1 for a gap that is removed or created, 0 if it doesn't exist) and their costs.
+    vector<const int*> batch_games;
+    vector<int> batch_sizes;
+    vector<int> batch_from;
+    vector<int> batch_to;
+    vector<int> batch_positions;
+    vector<int> batch_ranks;
+    vector<int> batch_moves;
+    vector<int> batch_gaps;
+    vector<float> batch_weights;
+    vector<float> batch_costs;
+    // Track the indices of games for each team.
+    TeamGameIndex team_to_games;
+    // The slots of every team as bitsets, for checking the hard constraints.
+    HardConstraints constraints;
+    // The running total of every extra cost term (before weighting), and the change in every term caused by the 
+    // most recently evaluated move.
+    vector<double> term_totals;
+    vector<double> term_changes;
+    // The largest reach of the extra cost terms.
+    int term_reach = 0;
+    // Scratch space for the games of a team before and after a move.
+    vector<TeamGame> old_sequence;
+    vector<TeamGame> new_sequence;
+    // The slots of the pinned games (sorted), and the slots [window_lo, window_hi] that moves are restricted to 
+    // while re-optimising after an edit (every slot when window_hi < window_lo).
+    vector<int> pinned_slots;
+    int window_lo = 0;
+    int window_hi = -1;
+    // Track the cost of removing the game at the given index (negative change means removing the 
+    // game is beneficial).
+    vector<float> cost_of_removing_game;
+    // Track the indices of the games which have the best change in cost when they are removed. This 
+    // set of indices is either updated after every swap or refreshed after (refresh_freq * num_worst_games^2) 
+    // iterations.
+    WorstGamesPool worst_games;
+    // Sampler over all games weighted by sampling_weight(cost of removing the game), which is kept up to date 
+    // in the same way as worst_games.
+    WeightedSampler game_sampler;
+    // The cost of the current schedule.
+    float cum_cost;
+    // The number of iterations since the worst games were last refreshed.
+    int iters_since_refresh = 0;
+    // The temperature of the current call to run_iterations, for moves whose proposals depend on it.
+    float run_temperature = 1.0;
+    // A cooling schedule set by set_cooling_schedule, and the schedule used by the current call to anneal.
+    unique_ptr<CoolingSchedule> cooling_schedule;
+    unique_ptr<CoolingSchedule> cooling;
+    // Where anneal is in its cooling schedule.
+    struct AnnealProgress {
+        float temperature;
+        // The number of iterations to run at this temperature, and the number run and accepted so far.
+        long iters;
+        long num_run;
+        long num_accepted;
+        // The total number of iterations run.
+        long iteration;
+        // The best cost when the stall counter was last reset, and the number of temperatures since then.
+        float stall_reference_cost;
+        int num_stalled_temperatures;
+    } progress;
+    // Whether the next call to anneal continues from a loaded checkpoint, and the cooling schedule's saved state.
+    bool resuming = false;
+    string resumed_cooling_state;
+    static constexpr array<char, 4> checkpoint_magic = {'S', 'S', 'C', 'K'};
+    static constexpr uint32_t checkpoint_version = 3;
+    long last_checkpoint_iteration = 0;
+    unique_ptr<CheckpointWriter> checkpoint_writer;
+    // Counters and the cost/temperature trace.
+    AnnealerMetrics metrics;
+    // The best schedule found by record_best and its cost.
+    float best_cost = numeric_limits<float>::infinity();
+    vector<TeamId> best_teams[2];
+
+    /*========================= 
+        Moves
+      =========================*/
+    // A kind of change to the schedule. Every iteration, a move proposes a random change and evaluates the change 
+    // in cost it would cause, and the change is applied if it is accepted.
+    class Move {
+    public:
+        explicit Move(ScheduleAnnealer& annealer) : annealer(annealer) {}
+        virtual ~Move() = default;
+        virtual const char* name() const = 0;
+        // Choose a random change, returning false if there is no change to make.
+        virtual bool propose() = 0;
+        // The change in cost that the proposed change would cause.
+        virtual float delta() = 0;
+        virtual void apply() = 0;
+        // The change that the acceptor decides on, which is the change in cost unless the probability of 
+        // proposing the change isn't the same as that of proposing its reverse.
+        virtual float acceptance_change(float cost_change) { return cost_change; }
+        // The work done by a proposal relative to evaluating a single change, so that adaptive move weights 
+        // compare kinds of moves by their improvement per unit of work.
+        virtual float relative_work() const { return 1.0; }
+
+    protected:
+        ScheduleAnnealer& annealer;
+    };
+
+    // Swap the games in two slots.
+    class SwapMove : public Move {
+    public:
+        using Move::Move;
+        const char* name() const override { return "swap"; }
+
+        bool propose() override {
+            tie(idx1, idx2) = annealer.choose_swap();
+            return true;
+        }
+
+        float delta() override { return annealer.swap_cost_change(idx1, idx2); }
+        void apply() override { annealer.apply_swap(idx1, idx2); }
+
+    private:
+        int idx1;
+        int idx2;
+    };
+
+    // Move a game up to max_move_span slots earlier or later, shifting the games in between by one slot.
+    class InsertionMove : public Move {
+    public:
+        using Move::Move;
+        const char* name() const override { return "insertion"; }
+
+        bool propose() override {
+            from_idx = annealer.choose_game();
+            int span = annealer.move_span();
+            // Draw an offset from [-span, -1] or [1, span].
+            int offset = annealer.random_index(2 * span) - span;
+            if (offset >= 0) {
+                offset++;
+            }
+            to_idx = clamp(from_idx + offset, annealer.first_free_slot(), annealer.last_free_slot());
+            return to_idx != from_idx;
+        }
+
+        float delta() override { return annealer.calculate_insertion_cost_change(from_idx, to_idx); }
+        void apply() override { annealer.apply_insertion(from_idx, to_idx); }
+
+    private:
+        int from_idx;
+        int to_idx;
+    };
+
+    // Reverse the order of the games in a range of 2 to max_move_span slots containing a chosen game.
+    class ReversalMove : public Move {
+    public:
+        using Move::Move;
+        const char* name() const override { return "reversal"; }
+
+        bool propose() override {
+            int first = annealer.first_free_slot();
+            int last = annealer.last_free_slot();
+            int length = min(last - first + 1, 2 + annealer.random_index(max(1, annealer.move_span() - 1)));
+            int idx = annealer.choose_game();
+            lo = clamp(idx - annealer.random_index(length), first, last - length + 1);
+            hi = lo + length - 1;
+            return length >= 2;
+        }
+
+        float delta() override { return annealer.calculate_reversal_cost_change(lo, hi); }
+        void apply() override { annealer.apply_reversal(lo, hi); }
+
+    private:
+        int lo;
+        int hi;
+    };
+
+    // Exchange two teams in every game they play.
+    class RelabelMove : public Move {
+    public:
+        using Move::Move;
+        const char* name() const override { return "relabel"; }
+
+        bool propose() override {
+            // Relabelling changes games throughout the schedule, so it isn't used while re-optimising a window.
+            int num_teams = annealer.team_to_games.num_teams();
+            if (num_teams < 2 || annealer.windowed()) {
+                return false;
+            }
+            team1 = annealer.random_index(num_teams);
+            team2 = annealer.random_index(num_teams - 1);
+            if (team2 >= team1) {
+                team2++;
+            }
+            return true;
+        }
+
+        float delta() override { return annealer.calculate_relabel_cost_change(team1, team2); }
+        void apply() override { annealer.apply_relabel(team1, team2); }
+
+        // Relabelling loads the whole sequences of both teams and of all of their opponents (before and after the 
+        // change), while a swap only looks at a few games around the two slots for each of its four teams.
+        float relative_work() const override {
+            int num_teams = annealer.team_to_games.num_teams();
+            double games_per_team = 2.0 * annealer.schedule_length / max(1, num_teams);
+            double teams_touched = min<double>(num_teams, 2 + 2 * games_per_team);
+            double swap_games = 4 * (2 * annealer.term_reach + 3);
+            return max(1.0, 2 * teams_touched * games_per_team / swap_games);
+        }
+
+    private:
+        TeamId team1;
+        TeamId team2;
+    };
+
+    // Draw multi_try_candidates uniformly random swaps, evaluate them together and choose one with probability 
+    // proportional to exp(-delta / T). The choice is accepted with the multiple-try Metropolis ratio: the total 
+    // weight of the candidates over that of a reference set drawn around the chosen schedule (the swap back to 
+    // the current schedule and multi_try_candidates - 1 random swaps), which keeps the chain balanced. At low 
+    // temperatures, where almost every single swap is rejected, this finds the rare improving swaps far more 
+    // often per proposal.
+    class MultiTrySwapMove : public Move {
+    public:
+        using Move::Move;
+        const char* name() const override { return "multi-try swap"; }
+
+        bool propose() override {
+            float temperature = annealer.run_temperature;
+            int count = max(2, annealer.config.multi_try_candidates);
+            draw_candidates(count);
+            annealer.calculate_swap_deltas(idx1s.data(), idx2s.data(), count, deltas.data());
+            float min_delta = *min_element(deltas.begin(), deltas.begin() + count);
+            if (isinf(min_delta)) {
+                return false;
+            }
+            // Choose a candidate with probability proportional to its weight, shifting the exponents by the 
+            // smallest change so that they can't overflow.
+            double total_weight = 0.0;
+            for (int c = 0; c < count; c++) {
+                weights[c] = exp(-(deltas[c] - min_delta) / temperature);
+                total_weight += weights[c];
+            }
+            double r = annealer.rng.uniform() * total_weight;
+            int chosen = -1;
+            for (int c = 0; c < count; c++) {
+                if (weights[c] > 0) {
+                    chosen = c;
+                    if ((r -= weights[c]) < 0) {
+                        break;
+                    }
+                }
+            }
+            idx1 = idx1s[chosen];
+            idx2 = idx2s[chosen];
+            chosen_delta = deltas[chosen];
+            double log_forward = log(total_weight) - min_delta / temperature;
+
+            // Evaluate the reference swaps from the chosen schedule, then swap back. Every energy is relative to 
+            // the current schedule, which is itself the last member of the reference set.
+            annealer.swap_tentatively(idx1, idx2);
+            draw_candidates(count - 1);
+            annealer.calculate_swap_deltas(idx1s.data(), idx2s.data(), count - 1, deltas.data());
+            annealer.swap_tentatively(idx1, idx2);
+            deltas[count - 1] = -chosen_delta;
+            float min_reverse = *min_element(deltas.begin(), deltas.begin() + count);
+            double reverse_weight = 0.0;
+            for (int c = 0; c < count; c++) {
+                reverse_weight += exp(-(deltas[c] - min_reverse) / temperature);
+            }
+            double log_reverse = log(reverse_weight) - (chosen_delta + min_reverse) / temperature;
+            // The acceptor accepts a change d with probability min(1, exp(-d / T)), so the ratio is passed to it 
+            // as the equivalent change.
+            acceptance = (float) (-temperature * (log_forward - log_reverse));
+            return true;
+        }
+
+        // The batch already costed the chosen swap, unless extra cost terms need their changes for the apply.
+        float delta() override {
+            return annealer.config.cost_terms.empty() ? chosen_delta : annealer.calculate_cost_change(idx1, idx2);
+        }
+        void apply() override { annealer.apply_swap(idx1, idx2); }
+        // The multiple-try ratio depends on the whole candidate and reference sets rather than on the change in 
+        // cost of the chosen swap alone, so it is computed by propose and the cost change isn't needed.
+        float acceptance_change(float) override { return acceptance; }
+        float relative_work() const override { return 2 * max(2, annealer.config.multi_try_candidates); }
+
+    private:
+        void draw_candidates(int count) {
+            idx1s.resize(max<int>(idx1s.size(), count));
+            idx2s.resize(idx1s.size());
+            deltas.resize(idx1s.size());
+            weights.resize(idx1s.size());
+            for (int c = 0; c < count; c++) {
+                tie(idx1s[c], idx2s[c]) = annealer.random_swap();
+            }
+        }
+
+        int idx1;
+        int idx2;
+        float chosen_delta;
+        float acceptance;
+        vector<int> idx1s;
+        vector<int> idx2s;
+        vector<float> deltas;
+        vector<double> weights;
+    };
+
+    struct MoveStats {
+        long proposals = 0;
+        long accepted = 0;
+        // The total decrease in cost from the accepted moves that improved the cost.
+        double improvement = 0.0;
+    };
+    // The kinds of moves with a non-zero weight, the probability of choosing each one, and the number of moves 
+    // of each kind proposed and accepted (in total and when the probabilities were last updated).
+    vector<unique_ptr<Move>> moves;
+    vector<float> move_probabilities;
+    vector<MoveStats> move_stats;
+    vector<MoveStats> move_stats_at_update;
+    int iters_since_move_update = 0;
+    // Scratch space for evaluating the range moves: the teams playing in the range (marked by the current 
+    // run_stamp) and the positions of the first and last of each team's games in the range.
+    vector<TeamId> run_teams;
+    vector<int> run_stamps;
+    int run_stamp = 0;
+    vector<int> run_first;
+    vector<int> run_last;
+    // The permutation applied by a range move (see TeamGameIndex::permute_range), and the new slots of a team's 
+    // games when checking a range move against the hard constraints.
+    vector<int> range_sources;
+    vector<int> new_run;
+
+    /*=========================
+        Helper Functions
+      =========================*/
+    // Generator for random numbers (owned by each annealer so that independent annealers can run on 
+    // different threads).
+    FastRng rng;
+    MetropolisAcceptor acceptor;
+    
+    // Pre-process schedule to improve efficiency of annealing algorithm.
+    void setup_annealer() {
+        // For every game in the schedule, add it to the sorted slots of both of its teams.
+        team_to_games.build(schedule);
+        constraints.build(schedule, config.rest_slots, config.round_length, config.blackouts);
+        bool only_swaps = config.insertion_weight == 0 && config.reversal_weight == 0 && config.relabel_weight == 0 
+            && config.multi_try_weight == 0;
+        use_delta_cache = config.cache_swap_deltas && config.cost_terms.empty() && only_swaps;
+        delta_cache.reset(team_to_games.num_teams(), use_delta_cache ? config.delta_cache_log2 : 0);
+
+        // Initialize the set of worst games.
+        refresh_worst_games();
+        term_reach = 0;
+        term_totals.clear();
+        for (const auto& term : config.cost_terms) {
+            term_reach = max(term_reach, term->reach());
+            term_totals.push_back(calculate_term_cost(*term));
+        }
+        term_changes = vector<double>(config.cost_terms.size(), 0.0);
+        cum_cost = calculate_total_cost();
+    }
+
+    // Recompute the set of worst games.
+    void refresh_worst_games() {
+        METRIC(metrics.current.refreshes++);
+        cost_of_removing_game = vector<float>(schedule_length, 0.0);
+        for (int i = 0; i < schedule_length; i++) {
+            cost_of_removing_game[i] = calculate_removal_cost(i);
+        }
+        
+        if (config.swap_sampling == SwapSampling::WorstGames) {
+            worst_games.build(cost_of_removing_game, config.num_worst_games);
+        } else {
+            rebuild_game_sampler();
+        }
+    }
+
+    void rebuild_game_sampler() {
+        vector<double> weights(schedule_length);
+        for (int i = 0; i < schedule_length; i++) {
+            weights[i] = config.sampling_weight(cost_of_removing_game[i]);
+        }
+        game_sampler.build(weights);
+    }
+
+    // Swap the games at idx1 and idx2 and update everything that depends on the order of the games.
+    void apply_swap(int idx1, int idx2) {
+        // The cost of removing a game depends on the neighbouring games of both of its teams, so the games next 
+        // to the swapped games (both before and after the swap) need their costs updated as well.
+        array<int, 18> affected;
+        int num_affected = 0;
+        if (config.incremental_refresh) {
+            affected[num_affected++] = idx1;
+            affected[num_affected++] = idx2;
+            num_affected = collect_neighbors(idx1, affected, num_affected);
+            num_affected = collect_neighbors(idx2, affected, num_affected);
+        }
+
+        if (constraints.active()) {
+            for (int side = 0; side < 2; side++) {
+                TeamId team1 = team_to_games.team_at(idx1, side);
+                TeamId team2 = team_to_games.team_at(idx2, side);
+                if (!plays_at(team1, idx2)) { constraints.move(team1, idx1, idx2); }
+                if (!plays_at(team2, idx1)) { constraints.move(team2, idx2, idx1); }
+            }
+        }
+
+        // Update the team_to_games index.
+        for (int side = 0; side < 2; side++) {
+            delta_cache.bump(team_to_games.team_at(idx1, side));
+            delta_cache.bump(team_to_games.team_at(idx2, side));
+        }
+        team_to_games.swap_slots(idx1, idx2);
+        schedule.swap_games(idx1, idx2);
+
+        if (config.incremental_refresh) {
+            num_affected = collect_neighbors(idx1, affected, num_affected);
+            num_affected = collect_neighbors(idx2, affected, num_affected);
+            for (int i = 0; i < num_affected; i++) {
+                update_removal_cost(affected[i]);
+            }
+        }
+    }
+
+    // Recompute the cost of removing the game at idx and update the structure used to sample games.
+    void update_removal_cost(int idx) {
+        cost_of_removing_game[idx] = calculate_removal_cost(idx);
+        if (config.swap_sampling == SwapSampling::WorstGames) {
+            worst_games.update(idx, cost_of_removing_game[idx]);
+        } else {
+            game_sampler.update(idx, config.sampling_weight(cost_of_removing_game[idx]));
+        }
+    }
+
+    // Add the indices of the games before and after the game at idx (for both of its teams) to affected.
+    int collect_neighbors(int idx, array<int, 18>& affected, int num_affected) {
+        for (int side = 0; side < 2; side++) {
+            auto [lower, upper] = team_to_games.neighbors(team_to_games.team_at(idx, side), 
+                                                          team_to_games.position_at(idx, side));
+            if (lower != -1) { affected[num_affected++] = lower; }
+            if (upper != -1) { affected[num_affected++] = upper; }
+        }
+        return num_affected;
+    }
+
+    // Calculate the change in cost from removing the game at idx (negative if removing it is beneficial).
+    float calculate_removal_cost(int idx) {
+        float removal_cost = 0.0;
+        for (int side = 0; side < 2; side++) {
+            auto [lower, upper] = team_to_games.neighbors(team_to_games.team_at(idx, side), 
+                                                          team_to_games.position_at(idx, side));
+            if (lower == -1 && upper != -1) {
+                // The first game of a team only has a gap with the next game.
+                removal_cost -= cost_func(upper - idx);
+            } else if (upper == -1 && lower != -1) {
+                // The last game of a team only has a gap with the previous game.
+                removal_cost -= cost_func(idx - lower);
+            } else if (lower != -1) {
+                // If you remove this game, the cost will change since the two existing gaps will 
+                // be merged into one larger gap.
+                removal_cost += cost_func(upper - lower) - cost_func(idx - lower) - cost_func(upper - idx);
+            }
+        }
+        return removal_cost;
+    }
+
+    // Return a uniformly random integer in [0, n).
+    int random_index(int n) {
+        return rng.bounded(n);
+    }
+
+    // Choose a single game in the same way as the games of a swap.
+    int choose_game() {
+        if (windowed()) {
+            return window_lo + random_index(window_hi - window_lo + 1);
+        }
+        if (rng.uniform() < config.random_swap_prob) {
+            return random_index(schedule_length);
+        } else if (config.swap_sampling == SwapSampling::WorstGames) {
+            return worst_games[random_index(worst_games.size())];
+        } else {
+            return game_sampler.sample(rng.uniform());
+        }
+    }
+
+    // Choose a swap of indices by either 1) selecting two of the games that are contributing the most to the 
+    // cost or 2) randomly selecting 2 games.
+    pair<int, int> choose_swap() {
+        // While re-optimising after an edit, both games are drawn uniformly from the window.
+        if (windowed()) {
+            return random_swap();
+        }
+        // There is a random_swap_prob chance of choosing a random swap. Otherwise, the swap is chosen from the 
+        // games whose removal is most beneficial.
+        if (rng.uniform() < config.random_swap_prob) {
+            int idx1 = random_index(schedule_length);
+            int idx2;
+            // Ensure that the two indices chosen aren't the same.
+            do {
+                idx2 = random_index(schedule_length);
+            } while (idx1 == idx2);
+            
+            return {idx1, idx2};
+        } else if (config.swap_sampling == SwapSampling::WorstGames) {
+            int idx1 = random_index(worst_games.size());
+            int idx2;
+            // Ensure that the two indices chosen aren't the same.
+            do {
+                idx2 = random_index(worst_games.size());
+            } while (idx1 == idx2);
+            
+            return {worst_games[idx1], worst_games[idx2]};
+        } else {
+            int idx1 = game_sampler.sample(rng.uniform());
+            int idx2 = game_sampler.sample(rng.uniform());
+            // If the same game is drawn twice, fall back to a uniformly random partner so that a game with a 
+            // dominant weight can't stall the sampler.
+            while (idx1 == idx2) {
+                idx2 = random_index(schedule_length);
+            }
+            
+            return {idx1, idx2};
+        }
+    }
+
+    // Choose two different slots uniformly from the slots that moves may change.
+    pair<int, int> random_swap() {
+        int length = last_free_slot() - first_free_slot() + 1;
+        int idx1 = random_index(length);
+        int idx2 = random_index(length - 1);
+        if (idx2 >= idx1) {
+            idx2++;
+        }
+        return {first_free_slot() + idx1, first_free_slot() + idx2};
+    }
+
+    // Calculate the change in cost from swapping the matchups at idx1 and idx2, through the delta cache if it is  
+    // used. The pair is always evaluated in the same order, so a cached change is identical to a fresh one.
+    float swap_cost_change(int idx1, int idx2) {
+        if (!use_delta_cache) {
+            return calculate_cost_change(idx1, idx2);
+        }
+        if (idx1 > idx2) {
+            swap(idx1, idx2);
+        }
+        array<TeamId, 4> teams = {team_to_games.team_at(idx1, 0), team_to_games.team_at(idx1, 1), 
+                                  team_to_games.team_at(idx2, 0), team_to_games.team_at(idx2, 1)};
+        if (optional<float> cached = delta_cache.find(idx1, idx2, teams)) {
+            return *cached;
+        }
+        float cost_change = calculate_cost_change(idx1, idx2);
+        delta_cache.store(idx1, idx2, teams, cost_change);
+        return cost_change;
+    }
+
+    // Calculate the change in cost from swapping the matchups at idx1 and idx2.
+    float calculate_cost_change(int idx1, int idx2) {
+        // If no swap is being made, the score won't change.
+        if (idx1 == idx2) {
+            fill(term_changes.begin(), term_changes.end(), 0.0);
+            return 0.0;
+        }
+        // An infeasible swap (or one that moves a pinned game) gets an infinite cost change, so that it is never 
+        // accepted.
+        if ((constraints.active() && !swap_allowed(idx1, idx2)) 
+            || (!pinned_slots.empty() && (pinned_in(idx1, idx1) || pinned_in(idx2, idx2)))) {
+            return numeric_limits<float>::infinity();
+        }
+        
+        float cost_change = 0.0;
+        for (int side = 0; side < 2; side++) {
+            cost_change += calculate_team_cost_change(idx1, side, idx2);
+            cost_change += calculate_team_cost_change(idx2, side, idx1);
+        }
+        if (!config.cost_terms.empty()) {
+            cost_change += calculate_swap_term_change(idx1, idx2);
+        }
+        return cost_change;
+    }
+
+    // Calculate the changes in cost from count swaps (the games at idx1s[c] and idx2s[c]) at once. Every swap 
+    // moves up to 4 teams, and the teams of all the swaps are resolved together in passes without per-team 
+    // branches: the rank of every destination slot among the team's games, then the 6 gaps that every team 
+    // removes or creates (in the same way as calculate_team_cost_change), then the costs of all the gaps in one 
+    // lookup. The extra cost terms are evaluated one swap at a time.
+    void calculate_swap_deltas(const int* idx1s, const int* idx2s, int count, float* deltas) {
+        if (!config.cost_terms.empty()) {
+            for (int c = 0; c < count; c++) {
+                deltas[c] = calculate_cost_change(idx1s[c], idx2s[c]);
+            }
+            return;
+        }
+        // Team k of the batch is on side (k / 2) % 2 of the game at idx1s[k / 4] (even k) or idx2s[k / 4] (odd k).
+        int num_movers = 4 * count;
+        batch_games.resize(num_movers);
+        batch_sizes.resize(num_movers);
+        batch_from.resize(num_movers);
+        batch_to.resize(num_movers);
+        batch_positions.resize(num_movers);
+        batch_ranks.resize(num_movers);
+        batch_moves.resize(num_movers);
+        for (int k = 0; k < num_movers; k++) {
+            int from_idx = k % 2 == 0 ? idx1s[k / 4] : idx2s[k / 4];
+            int to_idx = k % 2 == 0 ? idx2s[k / 4] : idx1s[k / 4];
+            int side = (k / 2) % 2;
+            TeamId team = team_to_games.team_at(from_idx, side);
+            const vector<int>& games = team_to_games.games(team);
+            batch_games[k] = games.data();
+            batch_sizes[k] = games.size();
+            batch_from[k] = from_idx;
+            batch_to[k] = to_idx;
+            batch_positions[k] = team_to_games.position_at(from_idx, side);
+            // A team that plays in both games doesn't move.
+            batch_moves[k] = (team_to_games.team_at(to_idx, 0) != team) & (team_to_games.team_at(to_idx, 1) != team);
+        }
+
+        // The rank of every destination among the team's games, by a binary search whose steps depend only on 
+        // the number of games (every team has at least 2).
+        for (int k = 0; k < num_movers; k++) {
+            const int* games = batch_games[k];
+            int to_idx = batch_to[k];
+            int base = 0;
+            for (int n = batch_sizes[k]; n > 1; n -= n / 2) {
+                base = games[base + n / 2] < to_idx ? base + n / 2 : base;
+            }
+            batch_ranks[k] = base + (games[base] < to_idx);
+        }
+
+        // Neighbours that don't exist are clamped to the ends of the team's games and their gaps weighted by 0.
+        int num_gaps = 6 * num_movers;
+        batch_gaps.resize(num_gaps);
+        batch_weights.resize(num_gaps);
+        batch_costs.resize(num_gaps);
+        for (int k = 0; k < num_movers; k++) {
+            const int* games = batch_games[k];
+            int last = batch_sizes[k] - 1;
+            int pos = batch_positions[k];
+            int rank = batch_ranks[k];
+            int from_idx = batch_from[k];
+            int to_idx = batch_to[k];
+            // The neighbours of the destination skip the game being moved.
+            int lower_pos = rank - 1 - (rank - 1 == pos);
+            int upper_pos = rank + (rank == pos);
+            int from_lower = games[max(pos - 1, 0)];
+            int from_upper = games[min(pos + 1, last)];
+            int to_lower = games[max(lower_pos, 0)];
+            int to_upper = games[min(upper_pos, last)];
+            // The flags are combined as integers, which (unlike float flags) compile without branches.
+            int has_from_lower = pos > 0;
+            int has_from_upper = pos < last;
+            int has_to_lower = lower_pos >= 0;
+            int has_to_upper = upper_pos <= last;
+            int moves = batch_moves[k];
+            int* gaps = &batch_gaps[6 * k];
+            float* weights = &batch_weights[6 * k];
+            // Removing the game splits off the gaps on either side of it and rejoins them, and adding it does the 
+            // reverse. Every gap is at least 1 so that the unused ones are still valid costs.
+            gaps[0] = max(from_idx - from_lower, 1);
+            gaps[1] = max(from_upper - from_idx, 1);
+            gaps[2] = max(from_upper - from_lower, 1);
+            gaps[3] = max(to_idx - to_lower, 1);
+            gaps[4] = max(to_upper - to_idx, 1);
+            gaps[5] = max(to_upper - to_lower, 1);
+            weights[0] = -(moves & has_from_lower);
+            weights[1] = -(moves & has_from_upper);
+            weights[2] = moves & has_from_lower & has_from_upper;
+            weights[3] = moves & has_to_lower;
+            weights[4] = moves & has_to_upper;
+            weights[5] = -(moves & has_to_lower & has_to_upper);
+        }
+        cost_model.costs(batch_gaps.data(), batch_costs.data(), num_gaps);
+
+        constexpr int gaps_per_swap = 4 * 6;
+        for (int c = 0; c < count; c++) {
+            const float* weights = &batch_weights[c * gaps_per_swap];
+            const float* costs = &batch_costs[c * gaps_per_swap];
+            float cost_change = 0.0;
+            for (int g = 0; g < gaps_per_swap; g++) {
+                cost_change += weights[g] * costs[g];
+            }
+            deltas[c] = cost_change;
+        }
+        // An infeasible swap (or one that moves a pinned game) gets an infinite cost change.
+        if (constraints.active() || !pinned_slots.empty()) {
+            for (int c = 0; c < count; c++) {
+                if ((constraints.active() && !swap_allowed(idx1s[c], idx2s[c])) 
+                    || (!pinned_slots.empty() && (pinned_in(idx1s[c], idx1s[c]) || pinned_in(idx2s[c], idx2s[c])))) {
+                    deltas[c] = numeric_limits<float>::infinity();
+                }
+            }
+        }
+    }
+
+    // Swap the games at idx1 and idx2 in the index, the schedule and the hard constraints only, to evaluate swaps 
+    // from the resulting schedule. Swapping the same games again restores the previous state exactly.
+    void swap_tentatively(int idx1, int idx2) {
+        if (constraints.active()) {
+            for (int side = 0; side < 2; side++) {
+                TeamId team1 = team_to_games.team_at(idx1, side);
+                TeamId team2 = team_to_games.team_at(idx2, side);
+                if (!plays_at(team1, idx2)) { constraints.move(team1, idx1, idx2); }
+                if (!plays_at(team2, idx1)) { constraints.move(team2, idx2, idx1); }
+            }
+        }
+        team_to_games.swap_slots(idx1, idx2);
+        schedule.swap_games(idx1, idx2);
+    }
+
+    // Whether swapping the games at idx1 and idx2 keeps every team that moves within the hard constraints (a team  
+    // that plays in both games doesn't move).
+    bool swap_allowed(int idx1, int idx2) {
+        for (int side = 0; side < 2; side++) {
+            TeamId team1 = team_to_games.team_at(idx1, side);
+            if (!plays_at(team1, idx2) && !constraints.allows_move(team1, idx1, idx2)) {
+                return false;
+            }
+            TeamId team2 = team_to_games.team_at(idx2, side);
+            if (!plays_at(team2, idx1) && !constraints.allows_move(team2, idx2, idx1)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool plays_at(TeamId team, int idx) const {
+        return team_to_games.team_at(idx, 0) == team || team_to_games.team_at(idx, 1) == team;
+    }
+
+    // Calculate the change in cost for the team playing on the given side of the game at from_idx when that 
+    // game is moved to to_idx.
+    float calculate_team_cost_change(int from_idx, int side, int to_idx) {
+        TeamId team = team_to_games.team_at(from_idx, side);
+        // If the team is in the other game as well, then the swap won't affect the cost.
+        if (team == team_to_games.team_at(to_idx, 0) || team == team_to_games.team_at(to_idx, 1)) {
+            return 0.0;
+        }
+        int pos = team_to_games.position_at(from_idx, side);
+
+        // Determine the indices of games with this team to the left and right of this game (-1 if 
+        // it doesn't exist).
+        auto [from_lower_bound_idx, from_upper_bound_idx] = team_to_games.neighbors(team, pos);
+
+        // Determine the indices of games with this team to the left and right of the new swapped 
+        // position of this game (-1 if it doesn't exist).
+        auto [to_lower_bound_idx, to_upper_bound_idx] = team_to_games.neighbors_around(team, to_idx, pos);
+
+        float cost_change = 0.0;
+        
+        // First, calculate the change in cost of removing the current game.
+        if (from_lower_bound_idx == -1) {
+            assert(from_upper_bound_idx != -1);
+            // By removing this game, the cost will be reduced by the cost based on the gap between this 
+            // game and the next game with this team.
+            cost_change -= cost_func(from_upper_bound_idx - from_idx);
+        } else if (from_upper_bound_idx == -1) {
+            assert(from_lower_bound_idx != -1);
+            // By removing this game, the cost will be reduced by the cost based on the gap between this 
+            // game and the previous game with this team.
+            cost_change -= cost_func(from_idx - from_lower_bound_idx);
+        } else {
+            // By removing this game, the cost will be reduced by the costs based on both the gap with the 
+            // next game and the gap with the previous game.
+            cost_change -= cost_func(from_upper_bound_idx - from_idx) + cost_func(from_idx - from_lower_bound_idx);
+            // Now, only a single gap remains - the gap between the next and previous games. Increase the cost 
+            // based on this gap.
+            cost_change += cost_func(from_upper_bound_idx - from_lower_bound_idx);
+        }
+
+        // Second, calculate the change in cost of adding the new game.
+        if (to_lower_bound_idx == -1) {
+            assert(to_upper_bound_idx != -1);
+            // By adding this game, the cost will be increased by the cost based on the gap between this 
+            // game and the next game with this team.
+            cost_change += cost_func(to_upper_bound_idx - to_idx);
+        } else if (to_upper_bound_idx == -1) {
+            assert(to_lower_bound_idx != -1);
+            // By adding this game, the cost will be increased by the cost based on the gap between this 
+            // game and the previous game with this team.
+            cost_change += cost_func(to_idx - to_lower_bound_idx);
+        } else {
+            // By adding this game, the cost will be increased by the costs based on both the gap with the 
+            // next game and the gap with the previous game.
+            cost_change += cost_func(to_upper_bound_idx - to_idx) + cost_func(to_idx - to_lower_bound_idx);
+            // Now, the gap the next and previous games has been split. Decrease the cost based on the gap 
+            // that was originally present (since that gap has now been split and no longer exists).
+            cost_change -= cost_func(to_upper_bound_idx - to_lower_bound_idx);
+        }
+
+        return cost_change;
+    }
+
+    // The maximum distance moved by an insertion and the maximum length of a reversal.
+    int move_span() const {
+        return config.max_move_span > 0 ? config.max_move_span : min(num_teams, 32);
+    }
+
+    // Whether moves are restricted to the slots [window_lo, window_hi].
+    bool windowed() const { return window_hi >= window_lo; }
+    // The first and last slots that moves may change.
+    int first_free_slot() const { return windowed() ? window_lo : 0; }
+    int last_free_slot() const { return windowed() ? window_hi : schedule_length - 1; }
+
+    // Whether any of the slots [lo, hi] holds a pinned game.
+    bool pinned_in(int lo, int hi) const {
+        auto it = lower_bound(pinned_slots.begin(), pinned_slots.end(), lo);
+        return it != pinned_slots.end() && *it <= hi;
+    }
+
+    // Whether either team plays in a pinned game (which relabelling the teams would change).
+    bool plays_pinned(TeamId team1, TeamId team2) const {
+        for (int idx : pinned_slots) {
+            if (plays_at(team1, idx) || plays_at(team2, idx)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Move the pins and blackouts at slots from first onwards by delta slots after a game is inserted or removed 
+    // (dropping the blackouts of a removed slot).
+    void shift_slot_references(int first, int delta) {
+        for (int& idx : pinned_slots) {
+            if (idx >= first) {
+                idx += delta;
+            }
+        }
+        vector<pair<TeamId, int>> blackouts;
+        for (auto [team, idx] : config.blackouts) {
+            if (delta < 0 && idx == first) {
+                continue;
+            }
+            blackouts.push_back({team, idx >= first ? idx + delta : idx});
+        }
+        config.blackouts = move(blackouts);
+    }
+
+    // Rebuild what depends on the length of the schedule or on every slot after an edit (the cost model, the hard 
+    // constraints, the removal costs and the extra cost terms), each in a single linear pass, and start the best 
+    // schedule from the edited one (the previous best has a different length).
+    void refresh_after_edit() {
+        cost_model = make_cost_model();
+        delta_cache.clear();
+        constraints.build(schedule, config.rest_slots, config.round_length, config.blackouts);
+        refresh_worst_games();
+        for (int i = 0; i < config.cost_terms.size(); i++) {
+            double total = calculate_term_cost(*config.cost_terms[i]);
+            cum_cost += config.cost_terms[i]->get_weight() * (total - term_totals[i]);
+            term_totals[i] = total;
+        }
+        reset_best();
+    }
+
+    // Forget the best schedule recorded so far and start again from the current one.
+    void reset_best() {
+        best_cost = cum_cost;
+        best_teams[0] = schedule.teams[0];
+        best_teams[1] = schedule.teams[1];
+    }
+
+    // Create the kinds of moves that have a non-zero weight.
+    void setup_moves() {
+        array<unique_ptr<Move>, 5> all_moves = {make_unique<SwapMove>(*this), make_unique<InsertionMove>(*this), 
+                                                make_unique<ReversalMove>(*this), make_unique<RelabelMove>(*this), 
+                                                make_unique<MultiTrySwapMove>(*this)};
+        // Relabelling never changes any gaps, so it is only made when extra cost terms can tell two labels apart.
+        float relabel_weight = config.cost_terms.empty() ? 0.0f : config.relabel_weight;
+        array<float, 5> weights = {config.swap_weight, config.insertion_weight, config.reversal_weight, 
+                                   relabel_weight, config.multi_try_weight};
+        float total_weight = 0.0;
+        for (int i = 0; i < all_moves.size(); i++) {
+            if (weights[i] > 0) {
+                moves.push_back(move(all_moves[i]));
+                move_probabilities.push_back(weights[i]);
+                total_weight += weights[i];
+            }
+        }
+        assert(!moves.empty());
+        for (float& probability : move_probabilities) {
+            probability /= total_weight;
+        }
+        move_stats = vector<MoveStats>(moves.size());
+        move_stats_at_update = move_stats;
+
+        run_stamps = vector<int>(team_to_games.num_teams(), 0);
+        run_first = vector<int>(team_to_games.num_teams());
+        run_last = vector<int>(team_to_games.num_teams());
+    }
+
+    int choose_move_type() {
+        if (moves.size() == 1) {
+            return 0;
+        }
+        float u = rng.uniform();
+        for (int i = 0; i + 1 < moves.size(); i++) {
+            u -= move_probabilities[i];
+            if (u < 0) {
+                return i;
+            }
+        }
+        return moves.size() - 1;
+    }
+
+    // Move the probability of each kind of move halfway towards its share of the improvement per proposal made 
+    // by the accepted moves since the last update. Weighting by the acceptance rate alone would favour moves that 
+    // are accepted because they hardly change anything (such as the short shifts of an insertion in a large 
+    // league, or a relabel, which never changes the cost).
+    void update_move_probabilities() {
+        iters_since_move_update = 0;
+        array<double, 5> gains;
+        double total_gain = 0.0;
+        for (int i = 0; i < moves.size(); i++) {
+            long proposals = move_stats[i].proposals - move_stats_at_update[i].proposals;
+            double improvement = move_stats[i].improvement - move_stats_at_update[i].improvement;
+            gains[i] = proposals > 0 ? improvement / (proposals * moves[i]->relative_work()) : 0.0;
+            total_gain += gains[i];
+        }
+        move_stats_at_update = move_stats;
+        if (total_gain == 0.0) {
+            return;
+        }
+        float total_probability = 0.0;
+        for (int i = 0; i < moves.size(); i++) {
+            move_probabilities[i] = max(config.min_move_probability, 
+                                        0.5f * move_probabilities[i] + (float) (0.5 * gains[i] / total_gain));
+            total_probability += move_probabilities[i];
+        }
+        for (float& probability : move_probabilities) {
+            probability /= total_probability;
+        }
+    }
+
+    // The number of moves of each kind that were proposed and accepted, and their current probabilities.
+    string describe_moves() const {
+        string description;
+        for (int i = 0; i < moves.size(); i++) {
+            description += (i > 0 ? ", " : "") + string(moves[i]->name()) + " " + 
+                to_string(move_stats[i].accepted) + "/" + to_string(move_stats[i].proposals) + " (p = " + 
+                to_string(move_probabilities[i]) + ")";
+        }
+        return description;
+    }
+
+    // The cost of the gap between two games of a team (0 if either game doesn't exist).
+    float gap_cost(int lower, int upper) {
+        return lower == -1 || upper == -1 ? 0.0 : cost_func(upper - lower);
+    }
+
+    // Find the teams playing in slots [lo, hi] (stored in run_teams) and the positions of the first and last of 
+    // each team's games in that range.
+    void collect_runs(int lo, int hi) {
+        if (++run_stamp == 0) {
+            fill(run_stamps.begin(), run_stamps.end(), 0);
+            run_stamp = 1;
+        }
+        run_teams.clear();
+        for (int idx = lo; idx <= hi; idx++) {
+            for (int side = 0; side < 2; side++) {
+                TeamId team = team_to_games.team_at(idx, side);
+                int pos = team_to_games.position_at(idx, side);
+                if (run_stamps[team] != run_stamp) {
+                    run_stamps[team] = run_stamp;
+                    run_first[team] = pos;
+                    run_teams.push_back(team);
+                }
+                run_last[team] = pos;
+            }
+        }
+    }
+
+    bool in_run(TeamId team) const { return run_stamps[team] == run_stamp; }
+
+    // Calculate the change in cost from moving the game at from_idx to to_idx and shifting the games in between 
+    // one slot towards from_idx. A shifted team keeps the gaps between its shifted games, so only the gaps at 
+    // the ends of its run of shifted games change (apart from the teams of the moved game).
+    float calculate_insertion_cost_change(int from_idx, int to_idx) {
+        bool moves_later = to_idx > from_idx;
+        int shift = moves_later ? -1 : 1;
+        // Every game between the two slots shifts by one towards from_idx.
+        auto new_slot = [=](int idx) { return idx == from_idx ? to_idx : idx + shift; };
+        int lo = min(from_idx, to_idx);
+        int hi = max(from_idx, to_idx);
+        if ((constraints.active() && !permutation_allowed(lo, hi, new_slot)) || pinned_in(lo, hi)) {
+            return numeric_limits<float>::infinity();
+        }
+        if (moves_later) {
+            collect_runs(from_idx + 1, to_idx);
+        } else {
+            collect_runs(to_idx, from_idx - 1);
+        }
+        TeamId moved_team1 = team_to_games.team_at(from_idx, 0);
+        TeamId moved_team2 = team_to_games.team_at(from_idx, 1);
+
+        float cost_change = 0.0;
+        for (TeamId team : run_teams) {
+            if (team == moved_team1 || team == moved_team2) {
+                continue;
+            }
+            const vector<int>& games = team_to_games.games(team);
+            int first = games[run_first[team]];
+            int last = games[run_last[team]];
+            int lower = run_first[team] > 0 ? games[run_first[team] - 1] : -1;
+            int upper = run_last[team] + 1 < games.size() ? games[run_last[team] + 1] : -1;
+            cost_change += gap_cost(lower, first + shift) - gap_cost(lower, first);
+            cost_change += gap_cost(last + shift, upper) - gap_cost(last, upper);
+        }
+
+        for (int side = 0; side < 2; side++) {
+            TeamId team = team_to_games.team_at(from_idx, side);
+            const vector<int>& games = team_to_games.games(team);
+            int pos = team_to_games.position_at(from_idx, side);
+            bool shifted = in_run(team);
+            if (moves_later) {
+                // The team's games are lower, from_idx, its shifted run (if any) and then upper.
+                int last_pos = shifted ? run_last[team] : pos;
+                int lower = pos > 0 ? games[pos - 1] : -1;
+                int upper = last_pos + 1 < games.size() ? games[last_pos + 1] : -1;
+                cost_change -= gap_cost(lower, from_idx);
+                if (shifted) {
+                    cost_change -= gap_cost(from_idx, games[pos + 1]) + gap_cost(games[last_pos], upper);
+                    cost_change += gap_cost(lower, games[pos + 1] - 1) + gap_cost(games[last_pos] - 1, to_idx);
+                } else {
+                    cost_change -= gap_cost(from_idx, upper);
+                    cost_change += gap_cost(lower, to_idx);
+                }
+                cost_change += gap_cost(to_idx, upper);
+            } else {
+                // The team's games are lower, its shifted run (if any), from_idx and then upper.
+                int first_pos = shifted ? run_first[team] : pos;
+                int lower = first_pos > 0 ? games[first_pos - 1] : -1;
+                int upper = pos + 1 < games.size() ? games[pos + 1] : -1;
+                cost_change -= gap_cost(from_idx, upper);
+                if (shifted) {
+                    cost_change -= gap_cost(lower, games[first_pos]) + gap_cost(games[pos - 1], from_idx);
+                    cost_change += gap_cost(to_idx, games[first_pos] + 1) + gap_cost(games[pos - 1] + 1, upper);
+                } else {
+                    cost_change -= gap_cost(lower, from_idx);
+                    cost_change += gap_cost(to_idx, upper);
+                }
+                cost_change += gap_cost(lower, to_idx);
+            }
+        }
+        if (!config.cost_terms.empty()) {
+            cost_change += calculate_range_term_change(lo, hi, new_slot);
+        }
+        return cost_change;
+    }
+
+    // Calculate the change in cost from reversing the order of the games in slots [lo, hi]. The gaps within 
+    // each team's run of games in the range are only reversed, so just the gaps at the ends of the run change.
+    float calculate_reversal_cost_change(int lo, int hi) {
+        if ((constraints.active() && !permutation_allowed(lo, hi, [=](int idx) { return lo + hi - idx; })) 
+            || pinned_in(lo, hi)) {
+            return numeric_limits<float>::infinity();
+        }
+        collect_runs(lo, hi);
+        float cost_change = 0.0;
+        for (TeamId team : run_teams) {
+            const vector<int>& games = team_to_games.games(team);
+            int first = games[run_first[team]];
+            int last = games[run_last[team]];
+            int lower = run_first[team] > 0 ? games[run_first[team] - 1] : -1;
+            int upper = run_last[team] + 1 < games.size() ? games[run_last[team] + 1] : -1;
+            cost_change += gap_cost(lower, lo + hi - last) - gap_cost(lower, first);
+            cost_change += gap_cost(lo + hi - first, upper) - gap_cost(last, upper);
+        }
+        if (!config.cost_terms.empty()) {
+            cost_change += calculate_range_term_change(lo, hi, [=](int idx) { return lo + hi - idx; });
+        }
+        return cost_change;
+    }
+
+    // The two teams trade all of their slots, so the set of gaps (and therefore the gap cost) stays the same.
+    float calculate_relabel_cost_change(TeamId team1, TeamId team2) {
+        if ((constraints.active() && !constraints.allows_swap_teams(team1, team2)) || plays_pinned(team1, team2)) {
+            return numeric_limits<float>::infinity();
+        }
+        return config.cost_terms.empty() ? 0.0 : calculate_relabel_term_change(team1, team2);
+    }
+
+    // Whether moving the game at every slot idx in [lo, hi] to new_slot(idx) adds no violations of the hard 
+    // constraints for any team playing in the range.
+    template <typename NewSlot>
+    bool permutation_allowed(int lo, int hi, NewSlot new_slot) {
+        collect_runs(lo, hi);
+        for (TeamId team : run_teams) {
+            const vector<int>& games = team_to_games.games(team);
+            int first = run_first[team];
+            int last = run_last[team];
+            new_run.clear();
+            for (int pos = first; pos <= last; pos++) {
+                new_run.push_back(new_slot(games[pos]));
+            }
+            sort(new_run.begin(), new_run.end());
+            int lower = first > 0 ? games[first - 1] : -1;
+            int upper = last + 1 < games.size() ? games[last + 1] : -1;
+            if (constraints.violation_change(team, lower, &games[first], new_run.data(), new_run.size(), upper) > 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void apply_insertion(int from_idx, int to_idx) {
+        int lo = min(from_idx, to_idx);
+        range_sources.resize(abs(to_idx - from_idx) + 1);
+        iota(range_sources.begin(), range_sources.end(), lo);
+        if (to_idx > from_idx) {
+            rotate(range_sources.begin(), range_sources.begin() + 1, range_sources.end());
+        } else {
+            rotate(range_sources.begin(), range_sources.end() - 1, range_sources.end());
+        }
+        apply_permutation(lo);
+    }
+
+    void apply_reversal(int lo, int hi) {
+        range_sources.resize(hi - lo + 1);
+        iota(range_sources.rbegin(), range_sources.rend(), lo);
+        apply_permutation(lo);
+    }
+
+    // Rearrange the games in the range starting at lo according to range_sources and update everything that 
+    // depends on the order of the games.
+    void apply_permutation(int lo) {
+        int hi = lo + range_sources.size() - 1;
+        if (constraints.active()) {
+            for (int idx = lo; idx <= hi; idx++) {
+                constraints.remove(schedule.teams[0][idx], idx);
+                constraints.remove(schedule.teams[1][idx], idx);
+            }
+        }
+        team_to_games.permute_range(lo, range_sources);
+        for (int idx = lo; idx <= hi; idx++) {
+            schedule.teams[0][idx] = team_to_games.team_at(idx, 0);
+            schedule.teams[1][idx] = team_to_games.team_at(idx, 1);
+            delta_cache.bump(schedule.teams[0][idx]);
+            delta_cache.bump(schedule.teams[1][idx]);
+            if (constraints.active()) {
+                constraints.add(schedule.teams[0][idx], idx);
+                constraints.add(schedule.teams[1][idx], idx);
+            }
+        }
+
+        if (config.incremental_refresh) {
+            // Every game in the range may have new neighbours, and so do the games just outside the range that 
+            // are next to a team's run of games in the range.
+            for (int idx = lo; idx <= hi; idx++) {
+                update_removal_cost(idx);
+                for (int side = 0; side < 2; side++) {
+                    auto [lower, upper] = team_to_games.neighbors(team_to_games.team_at(idx, side), 
+                                                                  team_to_games.position_at(idx, side));
+                    if (lower != -1 && lower < lo) { update_removal_cost(lower); }
+                    if (upper != -1 && upper > hi) { update_removal_cost(upper); }
+                }
+            }
+        }
+    }
+
+    // Exchange the two teams in every game that either of them plays. Each game's slots stay the same, so the 
+    // cost of removing any game doesn't change.
+    void apply_relabel(TeamId team1, TeamId team2) {
+        delta_cache.bump(team1);
+        delta_cache.bump(team2);
+        team_to_games.swap_teams(team1, team2);
+        if (constraints.active()) {
+            constraints.swap_teams(team1, team2);
+        }
+        for (TeamId team : {team1, team2}) {
+            for (int idx : team_to_games.games(team)) {
+                schedule.teams[0][idx] = team_to_games.team_at(idx, 0);
+                schedule.teams[1][idx] = team_to_games.team_at(idx, 1);
+            }
+        }
+    }
+
+    // The given team's game at position pos of its array.
+    TeamGame team_game(TeamId team, int pos) { return team_game_at(team, team_to_games.games(team)[pos]); }
+
+    // The given team's game at slot idx (which the team must play in).
+    TeamGame team_game_at(TeamId team, int idx) {
+        int side = team_to_games.team_at(idx, 0) == team ? 0 : 1;
+        return {idx, team_to_games.team_at(idx, 1 - side), side == 0};
+    }
+
+    // Copy the team's games at positions [first, last] of its array into sequence.
+    void load_sequence(TeamId team, int first, int last, vector<TeamGame>& sequence) {
+        sequence.clear();
+        for (int pos = first; pos <= last; pos++) {
+            sequence.push_back(team_game(team, pos));
+        }
+    }
+
+    // The positions of the team's games that a change to slots [lo, hi] can affect through the extra cost terms: 
+    // the games within term_reach slots of the range and the closest game on either side of those.
+    pair<int, int> term_window(TeamId team, int lo, int hi) {
+        const vector<int>& games = team_to_games.games(team);
+        int first = lower_bound(games.begin(), games.end(), lo - term_reach) - games.begin() - 1;
+        int last = upper_bound(games.begin(), games.end(), hi + term_reach) - games.begin();
+        return {max(first, 0), min(last, (int) games.size() - 1)};
+    }
+
+    // Add the change in every extra term from a team's games in old_sequence being replaced by the ones in 
+    // new_sequence to term_changes.
+    void add_term_changes(TeamId team) {
+        for (int i = 0; i < config.cost_terms.size(); i++) {
+            const CostTerm& term = *config.cost_terms[i];
+            term_changes[i] += term.sequence_cost(team, new_sequence.data(), new_sequence.size()) 
+                - term.sequence_cost(team, old_sequence.data(), old_sequence.size());
+        }
+    }
+
+    // The weighted sum of term_changes.
+    float weighted_term_change() {
+        double change = 0.0;
+        for (int i = 0; i < config.cost_terms.size(); i++) {
+            change += config.cost_terms[i]->get_weight() * term_changes[i];
+        }
+        return change;
+    }
+
+    // Calculate the change in the extra cost terms from swapping the games at idx1 and idx2. Only the games around 
+    // the two slots are evaluated for every team that plays in either game.
+    float calculate_swap_term_change(int idx1, int idx2) {
+        fill(term_changes.begin(), term_changes.end(), 0.0);
+        for (int side = 0; side < 2; side++) {
+            TeamId team1 = team_to_games.team_at(idx1, side);
+            TeamId team2 = team_to_games.team_at(idx2, side);
+            // A team that plays in both games doesn't move, but its two games trade places.
+            add_swap_term_changes(team1, idx1, idx2, plays_at(team1, idx2));
+            if (!plays_at(team2, idx1)) {
+                add_swap_term_changes(team2, idx2, idx1, false);
+            }
+        }
+        return weighted_term_change();
+    }
+
+    // Add the term changes for a team whose game at from_idx moves to to_idx, or whose games at the two slots trade 
+    // places if it plays in both.
+    void add_swap_term_changes(TeamId team, int from_idx, int to_idx, bool plays_both) {
+        TeamGame from_game = team_game_at(team, from_idx);
+        TeamGame to_game = plays_both ? team_game_at(team, to_idx) : from_game;
+        auto [first1, last1] = term_window(team, from_idx, from_idx);
+        auto [first2, last2] = term_window(team, to_idx, to_idx);
+        if (first2 <= last1 && first1 <= last2) {
+            // The two windows overlap, so they have to be evaluated together.
+            add_swapped_sequence_changes(team, min(first1, first2), max(last1, last2), from_game, to_game, to_idx, 
+                                         plays_both, true);
+        } else {
+            add_swapped_sequence_changes(team, first1, last1, from_game, to_game, to_idx, plays_both, false);
+            add_swapped_sequence_changes(team, first2, last2, from_game, to_game, to_idx, plays_both, true);
+        }
+    }
+
+    // Add the term changes for the team's games at positions [first, last] when from_game moves to to_idx (or trades 
+    // places with to_game), where has_to says whether the window covers to_idx. The game at from_game.slot is 
+    // only removed if the window holds it.
+    void add_swapped_sequence_changes(TeamId team, int first, int last, const TeamGame& from_game, 
+                                      const TeamGame& to_game, int to_idx, bool plays_both, bool has_to) {
+        load_sequence(team, first, last, old_sequence);
+        new_sequence.clear();
+        for (const TeamGame& game : old_sequence) {
+            if (game.slot == from_game.slot) {
+                if (plays_both) {
+                    new_sequence.push_back({game.slot, to_game.opponent, to_game.home});
+                }
+            } else if (plays_both && game.slot == to_idx) {
+                new_sequence.push_back({game.slot, from_game.opponent, from_game.home});
+            } else {
+                new_sequence.push_back(game);
+            }
+        }
+        if (!plays_both && has_to) {
+            TeamGame moved = {to_idx, from_game.opponent, from_game.home};
+            new_sequence.insert(upper_bound(new_sequence.begin(), new_sequence.end(), moved, 
+                                            [](const TeamGame& a, const TeamGame& b) { return a.slot < b.slot; }), 
+                                moved);
+        }
+        add_term_changes(team);
+    }
+
+    // Calculate the change in the extra cost terms from moving the game at every slot idx in [lo, hi] to 
+    // new_slot(idx).
+    template <typename NewSlot>
+    float calculate_range_term_change(int lo, int hi, NewSlot new_slot) {
+        fill(term_changes.begin(), term_changes.end(), 0.0);
+        collect_runs(lo, hi);
+        for (TeamId team : run_teams) {
+            auto [first, last] = term_window(team, lo, hi);
+            load_sequence(team, first, last, old_sequence);
+            new_sequence = old_sequence;
+            for (TeamGame& game : new_sequence) {
+                if (game.slot >= lo && game.slot <= hi) {
+                    game.slot = new_slot(game.slot);
+                }
+            }
+            sort(new_sequence.begin(), new_sequence.end(), 
+                 [](const TeamGame& a, const TeamGame& b) { return a.slot < b.slot; });
+            add_term_changes(team);
+        }
+        return weighted_term_change();
+    }
+
+    // Calculate the change in the extra cost terms from relabelling two teams. Each of the two teams takes over 
+    // the other's games, and every opponent of either team sees the two teams trade places, so the whole 
+    // sequences of all of these teams are evaluated.
+    float calculate_relabel_term_change(TeamId team1, TeamId team2) {
+        fill(term_changes.begin(), term_changes.end(), 0.0);
+        auto relabelled = [=](TeamId team) { return team == team1 ? team2 : team == team2 ? team1 : team; };
+        if (++run_stamp == 0) {
+            fill(run_stamps.begin(), run_stamps.end(), 0);
+            run_stamp = 1;
+        }
+        run_teams.clear();
+        for (TeamId team : {team1, team2}) {
+            run_stamps[team] = run_stamp;
+            run_teams.push_back(team);
+        }
+        for (TeamId team : {team1, team2}) {
+            for (int idx : team_to_games.games(team)) {
+                for (int side = 0; side < 2; side++) {
+                    TeamId opponent = team_to_games.team_at(idx, side);
+                    if (run_stamps[opponent] != run_stamp) {
+                        run_stamps[opponent] = run_stamp;
+                        run_teams.push_back(opponent);
+                    }
+                }
+            }
+        }
+        for (TeamId team : run_teams) {
+            load_sequence(team, 0, team_to_games.games(team).size() - 1, old_sequence);
+            // The relabelled team plays the other team's games.
+            TeamId source = relabelled(team);
+            load_sequence(source, 0, team_to_games.games(source).size() - 1, new_sequence);
+            for (TeamGame& game : new_sequence) {
+                game.opponent = relabelled(game.opponent);
+            }
+            add_term_changes(team);
+        }
+        return weighted_term_change();
+    }
+
+    // Calculate the cost of an extra term for the whole schedule (before weighting).
+    double calculate_term_cost(const CostTerm& term) {
+        double total = 0.0;
+        for (int team = 0; team < team_to_games.num_teams(); team++) {
+            load_sequence(team, 0, team_to_games.games(team).size() - 1, old_sequence);
+            total += term.sequence_cost(team, old_sequence.data(), old_sequence.size());
+        }
+        return total;
+    }
+
+    // Calculate the cost of the entire schedule, including the extra cost terms.
+    float calculate_total_cost() {
+        double total = calculate_schedule_cost();
+        for (const auto& term : config.cost_terms) {
+            total += term->get_weight() * calculate_term_cost(*term);
+        }
+        return total;
+    }
+
+    // Replace the tracked costs with a full recomputation and return how far the tracked total had drifted from it.
+    float correct_cost_drift() {
+        float drift = cum_cost;
+        double total = calculate_schedule_cost();
+        for (int i = 0; i < config.cost_terms.size(); i++) {
+            term_totals[i] = calculate_term_cost(*config.cost_terms[i]);
+            total += config.cost_terms[i]->get_weight() * term_totals[i];
+        }
+        cum_cost = total;
+        return drift - cum_cost;
+    }
+
+    // Recompute every cost from scratch and throw if the tracked costs have drifted from them (by more than a 
+    // small fraction, since the tracked costs accumulate rounding errors).
+    void verify_costs() {
+        auto check = [](const string& name, double tracked, double actual) {
+            if (abs(tracked - actual) > 1e-3 * max(1.0, abs(actual))) {
+                throw runtime_error("Tracked " + name + " cost " + to_string(tracked) + " doesn't match " + 
+                                    to_string(actual));
+            }
+        };
+        for (int i = 0; i < config.cost_terms.size(); i++) {
+            check(config.cost_terms[i]->name(), term_totals[i], calculate_term_cost(*config.cost_terms[i]));
+        }
+        check("total", cum_cost, calculate_total_cost());
+    }
+
+    // The total of every cost term (before weighting), starting with the gap cost.
+    string describe_cost_terms() {
+        double gap_total = cum_cost;
+        string description;
+        for (int i = 0; i < config.cost_terms.size(); i++) {
+            gap_total -= config.cost_terms[i]->get_weight() * term_totals[i];
+            description += ", " + string(config.cost_terms[i]->name()) + " = " + to_string(term_totals[i]) + 
+                " (weight " + to_string(config.cost_terms[i]->get_weight()) + ")";
+        }
+        return "gap = " + to_string(gap_total) + description;
+    }
+
+    // Calculate the cost of the entire schedule as a function of the distances between games.
+    // (The schedule is evaluated from scratch by the evaluator rather than from the index, so that this can check 
+    // the incrementally maintained state.)
+    float calculate_schedule_cost(bool print_gaps = false) {
+        if (print_gaps) {
+            for (int team = 0; team < team_to_games.num_teams(); team++) {
+                cout << schedule.team_name(team) << ":";
+                const vector<int>& games = team_to_games.games(team);
+                for (int i = 1; i < games.size(); i++) {
+                    cout << " " << games[i] - games[i - 1];
+                }
+                cout << endl;
+            }
+        }
+        evaluator.load(schedule, team_to_games.num_teams());
+        return evaluator.cost(cost_model);
+    }
+
+    // Calculate distribution statistics for the gaps.
+    string calculate_gap_dist() {
+        evaluator.load(schedule, team_to_games.num_teams());
+        return evaluator.gap_distribution();
+    }
+
+    // This is the cost function used to evaluate a single gap in the schedule.
+    float cost_func(int gap) {
+        return cost_model(gap);
+    }
+
+    // Copy the complete state of the annealer into a buffer and hand it to the background checkpoint writer. The 
+    // index, the sampler and the cost model are rebuilt from the schedule when the checkpoint is loaded.
+    void save_checkpoint() {
+        BinaryWriter out;
+        out.write(checkpoint_magic);
+        out.write(checkpoint_version);
+        out.write<uint64_t>(schedule.team_names.size());
+        for (const string& name : schedule.team_names) {
+            out.write_string(name);
+        }
+        out.write_vector(schedule.teams[0]);
+        out.write_vector(schedule.teams[1]);
+        out.write(num_teams);
+        out.write(cum_cost);
+        out.write_vector(term_totals);
+        out.write(best_cost);
+        out.write_vector(best_teams[0]);
+        out.write_vector(best_teams[1]);
+        rng.save(out);
+        acceptor.save(out);
+        out.write(iters_since_refresh);
+        out.write_vector(move_probabilities);
+        out.write_vector(move_stats);
+        out.write_vector(move_stats_at_update);
+        out.write(iters_since_move_update);
+        out.write_vector(cost_of_removing_game);
+        if (config.swap_sampling == SwapSampling::WorstGames) {
+            worst_games.save(out);
+        }
+        out.write(progress);
+        BinaryWriter cooling_state;
+        cooling->save_state(cooling_state);
+        out.write_string(cooling_state.buffer());
+
+        if (!checkpoint_writer) {
+            checkpoint_writer = make_unique<CheckpointWriter>(config.checkpoint_path);
+        }
+        checkpoint_writer->submit(move(out.buffer()));
+        last_checkpoint_iteration = progress.iteration;
+    }
+
+    unique_ptr<CoolingSchedule> make_cooling_schedule() {
+        switch (config.cooling) {
+            case Cooling::TimeBudget:
+                return make_unique<TimeBudgetCooling>(config.initial_temperature, config.min_temperature, 
+                                                      config.cooling_rate, config.time_budget_seconds);
+            case Cooling::Adaptive: {
+                AdaptiveCooling::Parameters params = config.adaptive_cooling;
+                params.initial_temperature = config.initial_temperature;
+                params.min_temperature = config.min_temperature;
+                params.iters_per_temp = config.iters_per_temp;
+                return make_unique<AdaptiveCooling>(params);
+            }
+            default:
+                return make_unique<GeometricCooling>(config.initial_temperature, config.min_temperature, 
+                                                     config.cooling_rate, config.iters_per_temp);
+        }
+    }
+
+    CostModel make_cost_model() {
+        if (config.cost_curve) {
+            return CostModel(config.cost_curve, schedule_length);
+        }
+        // The target gap between conseuquent games for a given team is equal to num_teams / 2.
+        return CostModel(num_teams / 2.0, config.deviation_exponent, schedule_length);
+    }
+
+    // Print the current schedule.
+    void print_schedule() {
+        for (int i = 0; i < schedule_length; i++) {
+            cout << schedule.team_name(schedule.teams[0][i]) << " vs " << schedule.team_name(schedule.teams[1][i]) << endl;
+        }
+    }
+
+    void print_team_to_games() {
+        for (int team = 0; team < team_to_games.num_teams(); team++) {
+            cout << schedule.team_name(team) << ": ";
+            for (int game : team_to_games.games(team)) {
+                cout << game << " ";
+            }
+            cout << endl;
+        }
+    }
+
+    void print_worst_games() {
+        for (int i = 0; i < worst_games.size(); i++) {
+            cout << worst_games[i] << " ";
+        }
+        cout << endl;
+    }
+};
+
+// Parameters controlling parallel tempering.
+struct TemperingConfig {
+    // The number of replicas (each one runs on its own thread).
+    int num_replicas = max(2u, thread::hardware_concurrency());
+    // The temperatures of the coldest and hottest replicas. The temperatures in between form a geometric ladder.
+    float min_temperature = 10.0;
+    float max_temperature = 1000.0;
+    // The number of iterations each replica runs between attempts to exchange replicas.
+    int iters_per_exchange = 20000;
+    // The number of rounds of exchanges.
+    int num_exchanges = 100;
+    // Parameters for each replica's annealer (the temperature parameters are ignored). Replica i is seeded 
+    // with annealer_config.seed + i.
+    AnnealerConfig annealer_config;
+};
+
+// Run several replicas of the schedule at a fixed ladder of temperatures in parallel (one thread per replica) 
+// and periodically exchange the temperatures of neighbouring replicas, so that good schedules found by the 
+// hotter replicas can migrate down to the colder ones.
+class ParallelTempering {
+public:
+    ParallelTempering(const Schedule& schedule, int num_teams, const TemperingConfig& config = TemperingConfig()) 
+        : config(config), rng(config.annealer_config.seed) {
+        assert(config.num_replicas >= 2);
+        for (int i = 0; i < config.num_replicas; i++) {
+            AnnealerConfig annealer_config = config.annealer_config;
+            annealer_config.seed += i;
+            schedules.push_back(make_unique<Schedule>(schedule));
+            replicas.push_back(make_unique<ScheduleAnnealer>(*schedules.back(), num_teams, annealer_config));
+            // Replica i starts at the i-th coldest temperature.
+            temperatures.push_back(config.min_temperature * pow(config.max_temperature / config.min_temperature, 
+                                                                (float) i / (config.num_replicas - 1)));
+            replica_at.push_back(i);
+        }
+        replica_temperatures = temperatures;
+        num_exchanges_attempted = vector<int>(config.num_replicas - 1, 0);
+        num_exchanges_accepted = vector<int>(config.num_replicas - 1, 0);
+    }
+
+    void run() {
+        cout << "Initial Cost: " << replicas[0]->get_cost() << endl;
+
+        // Every round, each replica runs at its current temperature and then waits for the others. The last 
+        // replica to arrive attempts the exchanges before any of them start the next round.
+        int round = 0;
+        barrier sync(config.num_replicas, [&]() noexcept {
+            exchange_replicas(round % 2);
+            round++;
+        });
+
+        vector<thread> threads;
+        for (int i = 0; i < config.num_replicas; i++) {
+            threads.emplace_back([this, i, &sync]() {
+                for (int exchange = 0; exchange < config.num_exchanges; exchange++) {
+                    replicas[i]->run_iterations(replica_temperatures[i], config.iters_per_exchange);
+                    METRIC(replicas[i]->get_metrics().record(replica_temperatures[i], 
+                                                             (long) (exchange + 1) * config.iters_per_exchange, 
+                                                             replicas[i]->get_cost()));
+                    replicas[i]->record_best();
+                    sync.arrive_and_wait();
+                }
+            });
+        }
+        for (thread& t : threads) {
+            t.join();
+        }
+
+        for (int i = 0; i + 1 < config.num_replicas; i++) {
+            cout << "Exchange Rate for temperatures " << temperatures[i] << " and " << temperatures[i + 1] << " = " 
+                << (float) num_exchanges_accepted[i] / max(1, num_exchanges_attempted[i]) << endl;
+        }
+        ScheduleAnnealer& best = best_replica();
+        cout << "Best Cost: " << best.get_best_cost() << endl;
+    }
+
+    // The replica that found the best schedule.
+    ScheduleAnnealer& best_replica() {
+        int best = 0;
+        for (int i = 1; i < config.num_replicas; i++) {
+            if (replicas[i]->get_best_cost() < replicas[best]->get_best_cost()) {
+                best = i;
+            }
+        }
+        return *replicas[best];
+    }
+
+private:
+    TemperingConfig config;
+    vector<unique_ptr<Schedule>> schedules;
+    vector<unique_ptr<ScheduleAnnealer>> replicas;
+    // The ladder of temperatures (from coldest to hottest).
+    vector<float> temperatures;
+    // The index of the replica currently at each temperature of the ladder.
+    vector<int> replica_at;
+    // The temperature currently assigned to each replica.
+    vector<float> replica_temperatures;
+    vector<int> num_exchanges_attempted;
+    vector<int> num_exchanges_accepted;
+    // Generator for the exchange decisions (only used between rounds, so it doesn't need to be shared).
+    FastRng rng;
+
+    // Attempt to exchange the replicas at neighbouring temperatures, starting with the pair at offset (0 or 1) 
+    // so that alternating rounds cover every pair.
+    void exchange_replicas(int offset) {
+        for (int i = offset; i + 1 < config.num_replicas; i += 2) {
+            int cold = replica_at[i];
+            int hot = replica_at[i + 1];
+            // Accept the exchange with probability min(1, exp((1/T_cold - 1/T_hot) * (E_cold - E_hot))).
+            double log_ratio = (1.0 / temperatures[i] - 1.0 / temperatures[i + 1]) 
+                * (replicas[cold]->get_cost() - replicas[hot]->get_cost());
+            num_exchanges_attempted[i]++;
+            if (log_ratio >= 0 || rng.uniform() < exp(log_ratio)) {
+                num_exchanges_accepted[i]++;
+                swap(replica_at[i], replica_at[i + 1]);
+                replica_temperatures[cold] = temperatures[i + 1];
+                replica_temperatures[hot] = temperatures[i];
+            }
+        }
+    }
+};
+
+// Parameters controlling the island model (see Island).
+struct IslandConfig {
+    // The number of islands started by run_islands (each one is a separate process).
+    int num_islands = max(2u, thread::hardware_concurrency());
+    // The number of iterations an island runs between migrations.
+    int iters_per_migration = 50000;
+    // The probability that an island adopts a better schedule published by another island at a migration.
+    float adopt_probability = 0.5;
+    // Island i cools geometrically from annealer_config.initial_temperature to annealer_config.min_temperature, 
+    // running annealer_config.iters_per_temp iterations at every temperature, with a cooling rate spread evenly 
+    // from min_cooling_rate (island 0) to max_cooling_rate (the last island), and is seeded with 
+    // annealer_config.seed + i.
+    float min_cooling_rate = 0.3;
+    float max_cooling_rate = 0.8;
+    AnnealerConfig annealer_config;
+};
+
+// Board in POSIX shared memory through which annealing processes (islands) on one machine migrate schedules. 
+// Every island owns one slot holding the best schedule it has published, which only that island writes. A slot 
+// is guarded by a sequence counter that is odd while the slot is being written, so publishing never waits for 
+// readers, and a reader that sees the counter change while copying a slot retries. The board is created by the 
+// first process to open it and removed when the last process attached to it detaches.
+class IslandBoard {
+public:
+    IslandBoard(const string& name, int num_islands, int schedule_length, uint64_t fingerprint) 
+        : name(name), num_islands(num_islands), schedule_length(schedule_length) {
+        if (num_islands < 1) {
+            throw runtime_error("An island board needs at least one island");
+        }
+        slot_size = (sizeof(SlotHeader) + 2 * schedule_length * sizeof(TeamId) + cache_line - 1) / cache_line 
+            * cache_line;
+        size = cache_line + num_islands * slot_size;
+        int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0600);
+        if (fd < 0) {
+            throw runtime_error("Unable to open shared memory " + name);
+        }
+        struct stat info;
+        bool sized = fstat(fd, &info) == 0 
+            && (info.st_size == size || (info.st_size == 0 && ftruncate(fd, size) == 0));
+        data = sized ? (char*) mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : (char*) MAP_FAILED;
+        close(fd);
+        if (data == MAP_FAILED) {
+            throw runtime_error("Unable to map shared memory " + name + " (it may belong to another schedule)");
+        }
+
+        // The first process to arrive fills in the header, and the others wait for it.
+        BoardHeader& header = *(BoardHeader*) data;
+        uint32_t state = 0;
+        if (atomic_ref(header.state).compare_exchange_strong(state, 1)) {
+            header.num_islands = num_islands;
+            header.schedule_length = schedule_length;
+            header.fingerprint = fingerprint;
+            atomic_ref(header.state).store(2, memory_order_release);
+        }
+        while (atomic_ref(header.state).load(memory_order_acquire) != 2) {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+        if (header.num_islands != num_islands || header.schedule_length != schedule_length 
+            || header.fingerprint != fingerprint) {
+            munmap(data, size);
+            throw runtime_error("Shared memory " + name + " belongs to another schedule or number of islands");
+        }
+        atomic_ref(header.attached).fetch_add(1);
+    }
+
+    IslandBoard(const IslandBoard&) = delete;
+    IslandBoard& operator=(const IslandBoard&) = delete;
+
+    ~IslandBoard() {
+        if (atomic_ref(((BoardHeader*) data)->attached).fetch_sub(1) == 1) {
+            shm_unlink(name.c_str());
+        }
+        munmap(data, size);
+    }
+
+    // Publish a schedule (of the board's length) to the island's slot.
+    void publish(int island, float cost, const vector<TeamId>& home, const vector<TeamId>& away) {
+        assert(home.size() == schedule_length && away.size() == schedule_length);
+        SlotHeader& slot = slot_header(island);
+        uint64_t sequence = atomic_ref(slot.sequence).load(memory_order_relaxed);
+        atomic_ref(slot.sequence).store(sequence + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        memcpy(slot_teams(island), home.data(), schedule_length * sizeof(TeamId));
+        memcpy(slot_teams(island) + schedule_length, away.data(), schedule_length * sizeof(TeamId));
+        atomic_ref(slot.cost).store(cost, memory_order_relaxed);
+        atomic_ref(slot.sequence).store(sequence + 2, memory_order_release);
+    }
+
+    // The cost of the schedule the island last published (infinity if it hasn't published one). The cost may be 
+    // from a publication still in progress, so it is only a hint for choosing which slot to read.
+    float published_cost(int island) const {
+        SlotHeader& slot = slot_header(island);
+        if (atomic_ref(slot.sequence).load(memory_order_acquire) == 0) {
+            return numeric_limits<float>::infinity();
+        }
+        return atomic_ref(slot.cost).load(memory_order_relaxed);
+    }
+
+    // Copy the schedule the island last published, returning false if it hasn't published one or the slot kept 
+    // changing while it was being copied.
+    bool read(int island, vector<TeamId>& home, vector<TeamId>& away, float& cost) const {
+        SlotHeader& slot = slot_header(island);
+        home.resize(schedule_length);
+        away.resize(schedule_length);
+        for (int attempt = 0; attempt < 16; attempt++) {
+            uint64_t sequence = atomic_ref(slot.sequence).load(memory_order_acquire);
+            if (sequence == 0) {
+                return false;
+            }
+            if (sequence % 2 == 1) {
+                this_thread::yield();
+                continue;
+            }
+            memcpy(home.data(), slot_teams(island), schedule_length * sizeof(TeamId));
+            memcpy(away.data(), slot_teams(island) + schedule_length, schedule_length * sizeof(TeamId));
+            cost = atomic_ref(slot.cost).load(memory_order_relaxed);
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_ref(slot.sequence).load(memory_order_relaxed) == sequence) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    int get_num_islands() const { return num_islands; }
+
+private:
+    static constexpr size_t cache_line = 64;
+
+    // The first cache line of the board. state is 0 until a process starts filling in the header, 1 while it 
+    // does and 2 once it is done.
+    struct BoardHeader {
+        uint32_t state;
+        uint32_t attached;
+        uint32_t num_islands;
+        uint32_t schedule_length;
+        uint64_t fingerprint;
+    };
+    // The start of every slot (which is followed by the home teams and then the away teams of the schedule). 
+    // Slots are padded to whole cache lines so that islands publishing at the same time don't share a line.
+    struct SlotHeader {
+        uint64_t sequence;
+        float cost;
+    };
+    static_assert(sizeof(BoardHeader) <= cache_line);
+
+    string name;
+    int num_islands;
+    int schedule_length;
+    size_t slot_size;
+    size_t size;
+    char* data;
+
+    // The header of the island's slot. Every access to a slot goes through here first, so an island outside the 
+    // board is rejected before anything past the end of the mapping is touched.
+    SlotHeader& slot_header(int island) const {
+        if (island < 0 || island >= num_islands) {
+            throw runtime_error("Island " + to_string(island) + " is not on a board of " + to_string(num_islands));
+        }
+        return *(SlotHeader*) (data + cache_line + island * slot_size);
+    }
+    TeamId* slot_teams(int island) const { 
+        return (TeamId*) (data + cache_line + island * slot_size + sizeof(SlotHeader));
+    }
+};
+
+// Identify the teams and length of a schedule, so that islands only exchange schedules of the same games.
+uint64_t schedule_fingerprint(const Schedule& schedule) {
+    // FNV-1a over the length and the team names.
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&](string_view bytes) {
+        for (char c : bytes) {
+            hash = (hash ^ (unsigned char) c) * 1099511628211ull;
+        }
+    };
+    mix(to_string(schedule.size()));
+    for (const string& name : schedule.team_names) {
+        mix(name);
+        mix(string_view("\0", 1));
+    }
+    return hash;
+}
+
+// One island of the island model: an annealer that cools on its own, publishes its best schedule to the board 
+// every iters_per_migration iterations, and adopts the best schedule published by another island (with 
+// probability adopt_probability) when that schedule is better than its current one.
+class Island {
+public:
+    Island(Schedule& schedule, int num_teams, const IslandConfig& config, int island, IslandBoard& board) 
+        : config(config), island(island), board(board), rng(config.annealer_config.seed + island) {
+        int num_islands = board.get_num_islands();
+        if (island < 0 || island >= num_islands) {
+            throw runtime_error("Island " + to_string(island) + " is not on a board of " + to_string(num_islands));
+        }
+        // A rate of 1 or more would never reach the minimum temperature.
+        cooling_rate = config.min_cooling_rate 
+            + (config.max_cooling_rate - config.min_cooling_rate) * island / max(1, num_islands - 1);
+        if (!(cooling_rate > 0 && cooling_rate < 1)) {
+            throw runtime_error("Island " + to_string(island) + " has cooling rate " + to_string(cooling_rate) 
+                                + " outside (0, 1)");
+        }
+        AnnealerConfig annealer_config = config.annealer_config;
+        annealer_config.seed += island;
+        annealer = make_unique<ScheduleAnnealer>(schedule, num_teams, annealer_config);
+    }
+
+    // Anneal to the minimum temperature and finish with the best schedule found (which is also published).
+    void run() {
+        const AnnealerConfig& annealer_config = config.annealer_config;
+        long since_migration = 0;
+        for (float temperature = annealer_config.initial_temperature; temperature > annealer_config.min_temperature; 
+             temperature *= cooling_rate) {
+            for (long done = 0; done < annealer_config.iters_per_temp;) {
+                long chunk = min(annealer_config.iters_per_temp - done, config.iters_per_migration - since_migration);
+                annealer->run_iterations(temperature, chunk);
+                done += chunk;
+                since_migration += chunk;
+                if (since_migration >= config.iters_per_migration) {
+                    annealer->record_best();
+                    migrate();
+                    since_migration = 0;
+                }
+            }
+            annealer->record_best();
+        }
+        if (annealer->get_best_cost() < annealer->get_cost()) {
+            annealer->restore_best();
+        }
+        publish();
+    }
+
+    ScheduleAnnealer& get_annealer() { return *annealer; }
+    int get_num_adopted() const { return num_adopted; }
+
+private:
+    IslandConfig config;
+    int island;
+    IslandBoard& board;
+    unique_ptr<ScheduleAnnealer> annealer;
+    float cooling_rate;
+    // The cost of the schedule this island last published.
+    float published_cost = numeric_limits<float>::infinity();
+    int num_adopted = 0;
+    // Generator for the adoption decisions.
+    FastRng rng;
+    // Scratch space for a schedule read from the board.
+    vector<TeamId> home;
+    vector<TeamId> away;
+
+    void publish() {
+        if (annealer->get_best_cost() < published_cost) {
+            published_cost = annealer->get_best_cost();
+            Schedule best = annealer->get_best_schedule();
+            board.publish(island, published_cost, best.teams[0], best.teams[1]);
+        }
+    }
+
+    void migrate() {
+        publish();
+        // Only the slot of the most promising island is copied.
+        int source = -1;
+        float source_cost = annealer->get_cost();
+        for (int other = 0; other < board.get_num_islands(); other++) {
+            float cost = board.published_cost(other);
+            if (other != island && cost < source_cost) {
+                source = other;
+                source_cost = cost;
+            }
+        }
+        float cost;
+        if (source != -1 && rng.uniform() < config.adopt_probability && board.read(source, home, away, cost) 
+            && cost < annealer->get_cost()) {
+            annealer->adopt_schedule(home, away);
+            num_adopted++;
+        }
+    }
+};
+
+// Run config.num_islands islands as child processes of this one, migrating through a board private to this run, 
+// and return the best schedule published by any of them.
+Schedule run_islands(const Schedule& schedule, int num_teams, const IslandConfig& config) {
+    IslandBoard board("/schedule-islands-" + to_string(getpid()), config.num_islands, schedule.size(), 
+                      schedule_fingerprint(schedule));
+    cout.flush();
+    vector<pid_t> children;
+    for (int i = 0; i < config.num_islands; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            throw runtime_error("Unable to start island " + to_string(i));
+        }
+        if (pid == 0) {
+            // The island shares the parent's mapping of the board, and leaves with _exit so that it doesn't 
+            // detach the parent's board or flush the parent's buffers.
+            int status = 0;
+            try {
+                Schedule island_schedule = schedule;
+                Island island(island_schedule, num_teams, config, i, board);
+                island.run();
+                cout << "Island " << i << ": Best Cost = " << island.get_annealer().get_best_cost() 
+                     << ", Adopted Schedules = " << island.get_num_adopted() << endl;
+            } catch (const exception& e) {
+                cerr << "Island " << i << ": " << e.what() << endl;
+                status = 1;
+            }
+            _exit(status);
+        }
+        children.push_back(pid);
+    }
+    bool failed = false;
+    for (pid_t pid : children) {
+        int status;
+        failed |= waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    }
+    if (failed) {
+        throw runtime_error("An island failed");
+    }
+
+    int best = 0;
+    for (int i = 1; i < config.num_islands; i++) {
+        if (board.published_cost(i) < board.published_cost(best)) {
+            best = i;
+        }
+    }
+    Schedule result = schedule;
+    float cost;
+    if (!board.read(best, result.teams[0], result.teams[1], cost)) {
+        throw runtime_error("No island published a schedule");
+    }
+    return result;
+}
+
+// Parse a schedule of the form "A,B;C,D;...", interning the team names as they are encountered.
+Schedule parse_schedule(string_view schedule_str) {
+    Schedule schedule;
+    
+    size_t start = 0;
+    while (start < schedule_str.size()) {
+        size_t end = schedule_str.find(';', start);
+        if (end == string_view::npos) {
+            end = schedule_str.size();
+        }
+        string_view game = schedule_str.substr(start, end - start);
+        size_t split_loc = game.find(',');
+        TeamId team1 = schedule.intern_team(game.substr(0, split_loc));
+        TeamId team2 = schedule.intern_team(game.substr(split_loc + 1));
+        schedule.add_game(team1, team2);
+        start = end + 1;
+    }
+
+    return schedule;
+}
+
+
+// The text formats understood by read_schedule. In the schedule format, games are separated by ';' (or newlines) 
+// and teams by ','. In the CSV format, every line is a game whose first two fields are the teams (any further 
+// fields are ignored), optionally preceded by a header line that is only skipped when the caller says the file has 
+// one. Whitespace around names is ignored in both.
+enum class TextFormat {
+    Schedule,
+    Csv,
+};
+
+// Read a schedule from a stream in fixed-size chunks, interning team names as they are completed, so the input is 
+// never held in memory as a whole.
+Schedule read_schedule(istream& in, TextFormat format, bool skip_header = false) {
+    Schedule schedule;
+    string fields[2];
+    int field = 0;
+    bool skipping_line = format == TextFormat::Csv && skip_header;
+
+    auto end_game = [&]() {
+        if (field == 1 && !fields[0].empty() && !fields[1].empty()) {
+            TeamId team1 = schedule.intern_team(fields[0]);
+            TeamId team2 = schedule.intern_team(fields[1]);
+            schedule.add_game(team1, team2);
+        } else if (field != 0 || !fields[0].empty()) {
+            throw runtime_error("Malformed game after " + to_string(schedule.size()) + " games");
+        }
+        fields[0].clear();
+        fields[1].clear();
+        field = 0;
+    };
+
+    vector<char> buffer(1 << 16);
+    while (in) {
+        in.read(buffer.data(), buffer.size());
+        for (int i = 0; i < in.gcount(); i++) {
+            char c = buffer[i];
+            if (skipping_line) {
+                skipping_line = c != '\n';
+            } else if (c == '\n' || (c == ';' && format == TextFormat::Schedule)) {
+                end_game();
+            } else if (c == ',') {
+                // Extra CSV columns are skipped up to the end of the line, but a game in the schedule format only 
+                // has two teams.
+                if (++field == 2) {
+                    if (format != TextFormat::Csv) {
+                        throw runtime_error("Malformed game after " + to_string(schedule.size()) + " games");
+                    }
+                    field = 1;
+                    skipping_line = true;
+                    end_game();
+                }
+            } else if (!isspace((unsigned char) c)) {
+                fields[field] += c;
+            }
+        }
+    }
+    end_game();
+    return schedule;
+}
+
+// Write a schedule in the same "A,B;C,D;..." form that parse_schedule reads.
+void write_schedule(ostream& out, const Schedule& schedule) {
+    for (int i = 0; i < schedule.size(); i++) {
+        if (i > 0) {
+            out << ';';
+        }
+        out << schedule.team_name(schedule.teams[0][i]) << ',' << schedule.team_name(schedule.teams[1][i]);
+    }
+    out << '\n';
+}
+
+/*
+    Binary schedule format (all integers are in the byte order of the machine that wrote the file, so that the games 
+    can be used straight from the mapping; the version tells a reader whether its byte order matches):
+        char[4]   magic "SSCH"
+        uint32    version (1)
+        uint32    number of teams
+        uint32    number of games
+        for each team:
+            uint16    length of the name
+            char[]    name
+        padding to a multiple of 4 bytes
+        for each game:
+            uint16    team id of the first team
+            uint16    team id of the second team
+*/
+constexpr char binary_schedule_magic[4] = {'S', 'S', 'C', 'H'};
+constexpr uint32_t binary_schedule_version = 1;
+
+void write_binary_schedule(ostream& out, const Schedule& schedule) {
+    // The names are checked before anything is written, so a name that doesn't fit is never truncated.
+    for (const string& name : schedule.team_names) {
+        if (name.size() > numeric_limits<uint16_t>::max()) {
+            throw runtime_error("Team name too long for the binary format (" + to_string(name.size()) + " bytes)");
+        }
+    }
+    auto write_u32 = [&](uint32_t value) { out.write((const char*) &value, sizeof(value)); };
+    out.write(binary_schedule_magic, sizeof(binary_schedule_magic));
+    write_u32(binary_schedule_version);
+    write_u32(schedule.num_teams());
+    write_u32(schedule.size());
+    size_t offset = 16;
+    for (const string& name : schedule.team_names) {
+        uint16_t length = name.size();
+        out.write((const char*) &length, sizeof(length));
+        out.write(name.data(), length);
+        offset += sizeof(length) + length;
+    }
+    out.write("\0\0\0", (4 - offset % 4) % 4);
+    vector<TeamId> pairs(2 * schedule.size());
+    for (int i = 0; i < schedule.size(); i++) {
+        pairs[2 * i] = schedule.teams[0][i];
+        pairs[2 * i + 1] = schedule.teams[1][i];
+    }
+    out.write((const char*) pairs.data(), pairs.size() * sizeof(TeamId));
+}
+
+// Read-only memory mapping of a binary schedule file. The team names and games are views into the mapping, so 
+// nothing is copied until the schedule is converted with to_schedule.
+class MappedSchedule {
+public:
+    explicit MappedSchedule(const string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1) {
+            throw runtime_error("Unable to open " + path);
+        }
+        struct stat st;
+        if (fstat(fd, &st) == -1 || st.st_size < 16) {
+            close(fd);
+            throw runtime_error(path + " is not a binary schedule");
+        }
+        size = st.st_size;
+        data = (const char*) mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            throw runtime_error("Unable to map " + path);
+        }
+        parse(path);
+    }
+
+    ~MappedSchedule() { munmap((void*) data, size); }
+
+    MappedSchedule(const MappedSchedule&) = delete;
+    MappedSchedule& operator=(const MappedSchedule&) = delete;
+
+    const vector<string_view>& team_names() const { return names; }
+    uint32_t num_games() const { return games; }
+    // The interleaved (first team, second team) ids of every game.
+    const TeamId* pairs() const { return game_pairs; }
+
+    Schedule to_schedule() const {
+        Schedule schedule;
+        for (string_view name : names) {
+            schedule.intern_team(name);
+        }
+        schedule.teams[0].resize(games);
+        schedule.teams[1].resize(games);
+        for (uint32_t i = 0; i < games; i++) {
+            schedule.teams[0][i] = game_pairs[2 * i];
+            schedule.teams[1][i] = game_pairs[2 * i + 1];
+        }
+        return schedule;
+    }
+
+    // Whether the file at path starts with the binary schedule magic.
+    static bool is_binary(const string& path) {
+        char magic[4] = {};
+        ifstream(path, ios::binary).read(magic, sizeof(magic));
+        return equal(magic, magic + 4, binary_schedule_magic);
+    }
+
+private:
+    const char* data;
+    size_t size;
+    vector<string_view> names;
+    uint32_t games;
+    const TeamId* game_pairs;
+
+    void parse(const string& path) {
+        uint32_t header[3];
+        memcpy(header, data + 4, sizeof(header));
+        if (!equal(data, data + 4, binary_schedule_magic)) {
+            throw runtime_error(path + " is not a binary schedule");
+        }
+        if (header[0] == __builtin_bswap32(binary_schedule_version)) {
+            throw runtime_error(path + " was written on a machine with a different byte order");
+        }
+        if (header[0] != binary_schedule_version) {
+            throw runtime_error(path + " has unsupported version " + to_string(header[0]));
+        }
+        size_t offset = 16;
+        for (uint32_t i = 0; i < header[1]; i++) {
+            uint16_t length;
+            if (offset + sizeof(length) > size) {
+                throw runtime_error(path + " is truncated");
+            }
+            memcpy(&length, data + offset, sizeof(length));
+            offset += sizeof(length);
+            if (offset + length > size) {
+                throw runtime_error(path + " is truncated");
+            }
+            names.emplace_back(data + offset, length);
+            offset += length;
+        }
+        offset += (4 - offset % 4) % 4;
+        games = header[2];
+        if (offset + 2 * sizeof(TeamId) * (size_t) games > size) {
+            throw runtime_error(path + " is truncated");
+        }
+        game_pairs = (const TeamId*) (data + offset);
+        for (uint32_t i = 0; i < 2 * games; i++) {
+            if (game_pairs[i] >= names.size()) {
+                throw runtime_error(path + " refers to an unknown team");
+            }
+        }
+    }
+};
+
+// Check that the annealer can work on a loaded schedule: a swap needs two games, and every team needs a game on 
+// either side of each of its games' gaps (so at least two games).
+void check_schedule(const Schedule& schedule, const string& source) {
+    if (schedule.size() < 2) {
+        throw runtime_error(source + " has " + to_string(schedule.size()) + " games (at least 2 are needed)");
+    }
+    vector<int> num_games(schedule.num_teams(), 0);
+    for (int side = 0; side < 2; side++) {
+        for (TeamId team : schedule.teams[side]) {
+            num_games[team]++;
+        }
+    }
+    for (int team = 0; team < schedule.num_teams(); team++) {
+        if (num_games[team] < 2) {
+            throw runtime_error(source + ": team " + schedule.team_name(team) + " plays " + to_string(num_games[team]) 
+                                + " game (every team needs at least 2)");
+        }
+    }
+}
+
+// Load a schedule from a binary file (detected by its magic), a CSV file (detected by a .csv extension, whose first 
+// line is skipped if csv_header is set) or a text file in the "A,B;C,D;..." format. A path of "-" reads text from 
+// stdin. Schedules the annealer can't work on are rejected (see check_schedule).
+Schedule load_schedule(const string& path, bool csv_header = false) {
+    Schedule schedule;
+    if (path == "-") {
+        schedule = read_schedule(cin, TextFormat::Schedule);
+    } else if (MappedSchedule::is_binary(path)) {
+        schedule = MappedSchedule(path).to_schedule();
+    } else {
+        ifstream in(path);
+        if (!in) {
+            throw runtime_error("Unable to open " + path);
+        }
+        schedule = read_schedule(in, path.ends_with(".csv") ? TextFormat::Csv : TextFormat::Schedule, csv_header);
+    }
+    check_schedule(schedule, path == "-" ? "stdin" : path);
+    return schedule;
+}
+
+// Save a schedule in the binary format if path ends with ".ssch" and in the text format otherwise.
+void save_schedule(const string& path, const Schedule& schedule) {
+    if (path.ends_with(".ssch")) {
+        ofstream out(path, ios::binary);
+        write_binary_schedule(out, schedule);
+    } else {
+        ofstream out(path);
+        write_schedule(out, schedule);
+    }
+}
+
+// Load the travel cost term from a file of "TEAM1,TEAM2,distance" lines. Distances are symmetric, and pairs that 
+// aren't listed are zero apart.
+shared_ptr<const CostTerm> load_travel_term(const string& path, const Schedule& schedule, float weight) {
+    ifstream in(path);
+    if (!in) {
+        throw runtime_error("Unable to open " + path);
+    }
+    int num_teams = schedule.num_teams();
+    vector<float> distances((size_t) num_teams * num_teams, 0.0);
+    string line;
+    int line_num = 0;
+    while (getline(in, line)) {
+        line_num++;
+        if (line.empty()) {
+            continue;
+        }
+        size_t first_split = line.find(',');
+        size_t second_split = first_split == string::npos ? string::npos : line.find(',', first_split + 1);
+        optional<TeamId> team1 = 
+            first_split == string::npos ? nullopt : schedule.find_team(line.substr(0, first_split));
+        optional<TeamId> team2 = second_split == string::npos ? nullopt 
+            : schedule.find_team(line.substr(first_split + 1, second_split - first_split - 1));
+        if (!team1 || !team2) {
+            throw runtime_error(path + ":" + to_string(line_num) + ": expected TEAM1,TEAM2,distance");
+        }
+        float distance = stof(line.substr(second_split + 1));
+        distances[*team1 * num_teams + *team2] = distance;
+        distances[*team2 * num_teams + *team1] = distance;
+    }
+    return make_shared<TravelTerm>(weight, num_teams, move(distances));
+}
+
+// Thread pool where every worker has its own deque of jobs. Workers take jobs from the back of their own deque and, 
+// once it is empty, steal from the front of the other workers' deques, so that many small jobs of uneven size 
+// keep every core busy without contending on a single queue.
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(int num_workers) : queues(num_workers) {}
+
+    // Run every job and return once they have all finished. Jobs must not submit further jobs.
+    void run(vector<function<void()>> jobs) {
+        for (int i = 0; i < jobs.size(); i++) {
+            queues[i % queues.size()].jobs.push_back(move(jobs[i]));
+        }
+        vector<thread> workers;
+        for (int i = 0; i < queues.size(); i++) {
+            workers.emplace_back([this, i]() { work(i); });
+        }
+        for (thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+private:
+    struct Queue {
+        mutex lock;
+        deque<function<void()>> jobs;
+    };
+
+    vector<Queue> queues;
+
+    void work(int worker) {
+        while (true) {
+            function<void()> job;
+            if (!take(worker, job)) {
+                // Every queue is empty, and since no new jobs can appear, this worker is done.
+                return;
+            }
+            job();
+        }
+    }
+
+    bool take(int worker, function<void()>& job) {
+        {
+            lock_guard<mutex> guard(queues[worker].lock);
+            if (!queues[worker].jobs.empty()) {
+                job = move(queues[worker].jobs.back());
+                queues[worker].jobs.pop_back();
+                return true;
+            }
+        }
+        for (int offset = 1; offset < queues.size(); offset++) {
+            Queue& victim = queues[(worker + offset) % queues.size()];
+            lock_guard<mutex> guard(victim.lock);
+            if (!victim.jobs.empty()) {
+                job = move(victim.jobs.front());
+                victim.jobs.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// One schedule to optimise in batch mode.
+struct BatchJob {
+    string schedule_path;
+    // Where to write the optimised schedule (nothing is written if empty).
+    string output_path;
+    // The number of teams used to compute the target gap (0 means the number of teams in the schedule).
+    int num_teams = 0;
+    // Whether the schedule is a CSV file with a header line.
+    bool csv_header = false;
+    AnnealerConfig config;
+};
+
+// Read a batch manifest. Every non-empty line that doesn't start with '#' describes one job: the path of a schedule 
+// file followed by optional key=value settings (seed, teams, output, iters, initial_temperature, min_temperature, 
+// cooling_rate, budget, rest, round_length, home_away, rematch, csv_header). Jobs without a seed are seeded with 
+// their line number.
+vector<BatchJob> read_manifest(const string& path) {
+    ifstream in(path);
+    if (!in) {
+        throw runtime_error("Unable to open " + path);
+    }
+    vector<BatchJob> jobs;
+    string line;
+    for (int line_num = 1; getline(in, line); line_num++) {
+        stringstream ss(line);
+        BatchJob job;
+        if (!(ss >> job.schedule_path) || job.schedule_path[0] == '#') {
+            continue;
+        }
+        job.config.verbose = false;
+        job.config.seed = line_num;
+        for (string setting; ss >> setting; ) {
+            size_t split_loc = setting.find('=');
+            if (split_loc == string::npos) {
+                throw runtime_error(path + ":" + to_string(line_num) + ": expected key=value, got " + setting);
+            }
+            string key = setting.substr(0, split_loc);
+            string value = setting.substr(split_loc + 1);
+            if (key == "seed") {
+                job.config.seed = stoull(value);
+            } else if (key == "teams") {
+                job.num_teams = stoi(value);
+            } else if (key == "csv_header") {
+                job.csv_header = value == "1" || value == "true";
+            } else if (key == "output") {
+                job.output_path = value;
+            } else if (key == "iters") {
+                job.config.iters_per_temp = stoi(value);
+            } else if (key == "initial_temperature") {
+                job.config.initial_temperature = stof(value);
+            } else if (key == "min_temperature") {
+                job.config.min_temperature = stof(value);
+            } else if (key == "cooling_rate") {
+                job.config.cooling_rate = stof(value);
+            } else if (key == "budget") {
+                job.config.cooling = Cooling::TimeBudget;
+                job.config.time_budget_seconds = stod(value);
+            } else if (key == "rest") {
+                job.config.rest_slots = stoi(value);
+            } else if (key == "round_length") {
+                job.config.round_length = stoi(value);
+            } else if (key == "home_away") {
+                job.config.cost_terms.push_back(make_shared<HomeAwayTerm>(stof(value)));
+            } else if (key == "rematch") {
+                job.config.cost_terms.push_back(make_shared<RematchTerm>(1.0, stoi(value)));
+            } else {
+                throw runtime_error(path + ":" + to_string(line_num) + ": unknown setting " + key);
+            }
+        }
+        jobs.push_back(job);
+    }
+    return jobs;
+}
+
+// Optimise every schedule in the manifest on a work-stealing pool, with one independent annealer per job. A line 
+// of results is written as soon as each job finishes.
+void run_batch(const string& manifest_path, int num_threads) {
+    vector<BatchJob> jobs = read_manifest(manifest_path);
+    mutex output_lock;
+    cout << "job,schedule,games,initial_cost,final_cost,violations,seconds\n" << flush;
+
+    vector<function<void()>> tasks;
+    for (int i = 0; i < jobs.size(); i++) {
+        tasks.push_back([&, i]() {
+            const BatchJob& job = jobs[i];
+            auto start = chrono::steady_clock::now();
+            string result;
+            try {
+                Schedule schedule = load_schedule(job.schedule_path, job.csv_header);
+                int num_teams = job.num_teams > 0 ? job.num_teams : schedule.num_teams();
+                ScheduleAnnealer annealer(schedule, num_teams, job.config);
+                float initial_cost = annealer.get_cost();
+                annealer.anneal();
+                if (!job.output_path.empty()) {
+                    save_schedule(job.output_path, schedule);
+                }
+                double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+                result = to_string(i) + ',' + job.schedule_path + ',' + to_string(schedule.size()) + ',' 
+                    + to_string(initial_cost) + ',' + to_string(annealer.get_cost()) + ',' 
+                    + to_string(annealer.count_violations()) + ',' + to_string(seconds);
+            } catch (const exception& e) {
+                result = to_string(i) + ',' + job.schedule_path + ",error," + e.what();
+            }
+            lock_guard<mutex> guard(output_lock);
+            cout << result << '\n' << flush;
+        });
+    }
+
+    WorkStealingPool pool(num_threads);
+    pool.run(move(tasks));
+}
+
+// Generate a synthetic league with num_teams teams where every team plays games_per_team games. With round_robin, 
+// the games come from repeated rounds of a round-robin tournament; otherwise the opponents are random. Either 
+// way, the games are shuffled so that the annealer starts from a random order.
+Schedule generate_schedule(int num_teams, int games_per_team, bool round_robin, uint64_t seed) {
+    assert(num_teams >= 2 && (long) num_teams * games_per_team % 2 == 0);
+    FastRng rng(seed);
+    Schedule schedule;
+    for (int team = 0; team < num_teams; team++) {
+        schedule.intern_team("T" + to_string(team));
+    }
+
+    if (round_robin) {
+        // Circle method: team 0 stays fixed and the others rotate one position every round. With an odd number 
+        // of teams, the extra position is a bye.
+        int num_positions = num_teams + num_teams % 2;
+        vector<int> circle(num_positions);
+        iota(circle.begin(), circle.end(), 0);
+        vector<int> games_played(num_teams, 0);
+        // Stop early if a full cycle of rounds adds no games (the teams still missing games have no partners 
+        // left), which can leave a few teams one or two games short.
+        int rounds_without_games = 0;
+        while (*min_element(games_played.begin(), games_played.end()) < games_per_team 
+               && rounds_without_games < num_positions) {
+            int num_games = schedule.size();
+            for (int i = 0; i < num_positions / 2; i++) {
+                int team1 = circle[i];
+                int team2 = circle[num_positions - 1 - i];
+                if (team1 < num_teams && team2 < num_teams && games_played[team1] < games_per_team 
+                    && games_played[team2] < games_per_team) {
+                    schedule.add_game(team1, team2);
+                    games_played[team1]++;
+                    games_played[team2]++;
+                }
+            }
+            rotate(circle.begin() + 1, circle.end() - 1, circle.end());
+            rounds_without_games = schedule.size() == num_games ? rounds_without_games + 1 : 0;
+        }
+    } else {
+        // Pair up a shuffled list containing every team games_per_team times, re-drawing the partner of any team 
+        // that would play itself.
+        vector<int> slots;
+        for (int team = 0; team < num_teams; team++) {
+            slots.insert(slots.end(), games_per_team, team);
+        }
+        shuffle(slots.begin(), slots.end(), rng);
+        for (int i = 0; i < slots.size(); i += 2) {
+            while (slots[i] == slots[i + 1]) {
+                int j = rng.bounded(slots.size());
+                if (slots[j] != slots[i] && (j % 2 == 0 ? slots[j + 1] : slots[j - 1]) != slots[i + 1]) {
+                    swap(slots[i + 1], slots[j]);
+                }
+            }
+        }
+        for (int i = 0; i < slots.size(); i += 2) {
+            schedule.add_game(slots[i], slots[i + 1]);
+        }
+    }
+
+    for (int i = schedule.size() - 1; i > 0; i--) {
+        schedule.swap_games(i, rng.bounded(i + 1));
+    }
     return schedule;
 }
 
+// Micro and end-to-end benchmarks of the annealer on synthetic leagues. Every measurement is written as one 
+// record (a JSON object per line or a CSV row) so that results can be compared across changes.
+class ScheduleBenchmark {
+public:
+    struct Options {
+        vector<int> team_counts = {4, 32, 256, 1000, 5000};
+        int games_per_team = 16;
+        bool round_robin = false;
+        uint64_t seed = 1;
+        // The number of operations timed by each microbenchmark.
+        int micro_ops = 200000;
+        // The number of iterations run by the end-to-end benchmark (at a fixed temperature).
+        int anneal_iters = 2000000;
+        float temperature = 10.0;
+        // The cost at which the end-to-end benchmark records its time to target (relative to the initial cost).
+        float target_fraction = 0.1;
+        bool csv = false;
+    };
+
+    explicit ScheduleBenchmark(const Options& options) : options(options) {}
+
+    void run() {
+        if (options.csv) {
+            cout << "benchmark,teams,games,structure,metric,value\n";
+        }
+        for (int num_teams : options.team_counts) {
+            Schedule schedule = generate_schedule(num_teams, options.games_per_team, options.round_robin, 
+                                                  options.seed);
+            run_micro(schedule, num_teams);
+            Schedule annealed = run_end_to_end(schedule, num_teams);
+            run_low_temperature(annealed, num_teams);
+        }
+        cout.flush();
+    }
+
+private:
+    using Clock = chrono::steady_clock;
+    Options options;
+    // Accumulates results of the benchmarked calls so that they can't be optimised away.
+    double sink = 0.0;
+
+    void run_micro(const Schedule& initial, int num_teams) {
+        Schedule schedule = initial;
+        AnnealerConfig config;
+        config.seed = options.seed;
+        ScheduleAnnealer annealer(schedule, num_teams, config);
+        int n = options.micro_ops;
+
+        // Pre-draw the swaps so that only the cost change itself is timed.
+        vector<pair<int, int>> swaps(n);
+        for (auto& s : swaps) {
+            s = annealer.choose_swap();
+        }
+        auto start = Clock::now();
+        for (auto [idx1, idx2] : swaps) {
+            sink += annealer.calculate_cost_change(idx1, idx2);
+        }
+        report("calculate_cost_change", schedule, num_teams, {{"ns_per_op", nanos_since(start) / n}});
+
+        // The same swaps evaluated in batches of the default number of multiple-try candidates (timed per swap).
+        int batch_size = config.multi_try_candidates;
+        vector<int> idx1s(n);
+        vector<int> idx2s(n);
+        vector<float> deltas(batch_size);
+        for (int i = 0; i < n; i++) {
+            tie(idx1s[i], idx2s[i]) = swaps[i];
+        }
+        start = Clock::now();
+        for (int i = 0; i + batch_size <= n; i += batch_size) {
+            annealer.calculate_swap_deltas(&idx1s[i], &idx2s[i], batch_size, deltas.data());
+            sink += deltas[0];
+        }
+        report("calculate_swap_deltas", schedule, num_teams, {{"ns_per_op", nanos_since(start) / n}});
+
+        start = Clock::now();
+        for (int i = 0; i < n; i++) {
+            sink += annealer.choose_swap().first;
+        }
+        report("choose_swap", schedule, num_teams, {{"ns_per_op", nanos_since(start) / n}});
+
+        // The range moves are timed over ranges of up to the default span.
+        vector<pair<int, int>> ranges(n);
+        for (auto& r : ranges) {
+            int lo = annealer.random_index(schedule.size() - 1);
+            r = {lo, min(schedule.size() - 1, lo + 1 + annealer.random_index(annealer.move_span()))};
+        }
+        start = Clock::now();
+        for (auto [lo, hi] : ranges) {
+            sink += annealer.calculate_insertion_cost_change(lo, hi);
+        }
+        report("calculate_insertion_cost_change", schedule, num_teams, {{"ns_per_op", nanos_since(start) / n}});
+
+        start = Clock::now();
+        for (auto [lo, hi] : ranges) {
+            sink += annealer.calculate_reversal_cost_change(lo, hi);
+        }
+        report("calculate_reversal_cost_change", schedule, num_teams, {{"ns_per_op", nanos_since(start) / n}});
+
+        // The full refreshes are far more expensive, so they are run fewer times.
+        int full_ops = max(1, n / schedule.size());
+        start = Clock::now();
+        for (int i = 0; i < full_ops; i++) {
+            annealer.refresh_worst_games();
+        }
+        report("refresh_worst_games", schedule, num_teams, {{"ns_per_op", nanos_since(start) / full_ops}});
+
+        start = Clock::now();
+        for (int i = 0; i < full_ops; i++) {
+            sink += annealer.calculate_schedule_cost();
+        }
+        report("calculate_schedule_cost", schedule, num_teams, {{"ns_per_op", nanos_since(start) / full_ops}});
+
+        start = Clock::now();
+        for (int i = 0; i < full_ops; i++) {
+            sink += annealer.calculate_gap_dist().size();
+        }
+        report("calculate_gap_dist", schedule, num_teams, {{"ns_per_op", nanos_since(start) / full_ops}});
+    }
+
+    // Anneal from the initial schedule and return the annealed one.
+    Schedule run_end_to_end(const Schedule& initial, int num_teams) {
+        Schedule schedule = initial;
+        AnnealerConfig config;
+        config.seed = options.seed;
+        ScheduleAnnealer annealer(schedule, num_teams, config);
+        float initial_cost = annealer.get_cost();
+        float target_cost = initial_cost * options.target_fraction;
+        double seconds_to_target = -1.0;
+
+        // Run in chunks so that the time to reach the target cost can be recorded.
+        int chunk = 10000;
+        long num_accepted = 0;
+        auto start = Clock::now();
+        for (int iter = 0; iter < options.anneal_iters; iter += chunk) {
+            num_accepted += annealer.run_iterations(options.temperature, chunk);
+            if (seconds_to_target < 0 && annealer.get_cost() <= target_cost) {
+                seconds_to_target = nanos_since(start) * 1e-9;
+            }
+        }
+        double seconds = nanos_since(start) * 1e-9;
+        report("anneal", schedule, num_teams, {
+            {"proposals_per_sec", options.anneal_iters / seconds},
+            {"accepted_per_sec", num_accepted / seconds},
+            {"seconds_to_target", seconds_to_target},
+            {"initial_cost", initial_cost},
+            {"final_cost", annealer.get_cost()},
+        });
+        return schedule;
+    }
+
+    // Compare plain swaps with multiple-try swaps from the same annealed schedule at the benchmark temperature, 
+    // where most single swaps are rejected. Each kind of move runs on its own for the same time.
+    void run_low_temperature(const Schedule& annealed, int num_teams) {
+        for (bool multi_try : {false, true}) {
+            Schedule schedule = annealed;
+            AnnealerConfig config;
+            config.seed = options.seed;
+            config.insertion_weight = 0.0;
+            config.reversal_weight = 0.0;
+            config.swap_weight = multi_try ? 0.0 : 1.0;
+            config.multi_try_weight = multi_try ? 1.0 : 0.0;
+            ScheduleAnnealer annealer(schedule, num_teams, config);
+            float initial_cost = annealer.get_cost();
+            long num_proposals = 0;
+            long num_accepted = 0;
+            int chunk = 1000;
+            auto start = Clock::now();
+            double seconds = 0.0;
+            while (seconds < 1.0) {
+                num_accepted += annealer.run_iterations(options.temperature, chunk);
+                num_proposals += chunk;
+                seconds = nanos_since(start) * 1e-9;
+            }
+            report(multi_try ? "low_temperature_multi_try_swap" : "low_temperature_swap", schedule, num_teams, {
+                {"proposals_per_sec", num_proposals / seconds},
+                {"accepted_per_sec", num_accepted / seconds},
+                {"cost_change_per_sec", (annealer.get_cost() - initial_cost) / seconds},
+            });
+        }
+    }
+
+    double nanos_since(Clock::time_point start) {
+        return chrono::duration<double, nano>(Clock::now() - start).count();
+    }
+
+    void report(const string& name, const Schedule& schedule, int num_teams, 
+                const vector<pair<string, double>>& metrics) {
+        string structure = options.round_robin ? "round_robin" : "random";
+        if (options.csv) {
+            for (auto& [metric, value] : metrics) {
+                cout << name << ',' << num_teams << ',' << schedule.size() << ',' << structure << ',' << metric 
+                    << ',' << value << '\n';
+            }
+        } else {
+            cout << "{\"benchmark\": \"" << name << "\", \"teams\": " << num_teams << ", \"games\": " 
+                << schedule.size() << ", \"structure\": \"" << structure << "\"";
+            for (auto& [metric, value] : metrics) {
+                cout << ", \"" << metric << "\": " << value;
+            }
+            cout << "}\n";
+        }
+    }
+};
+
+// Parse the command line options of the bench mode (e.g. "bench --teams 32,256 --format csv").
+ScheduleBenchmark::Options parse_bench_options(int argc, char* argv[]) {
+    ScheduleBenchmark::Options options;
+    for (int i = 2; i + 1 < argc; i += 2) {
+        string flag = argv[i];
+        string value = argv[i + 1];
+        if (flag == "--teams") {
+            options.team_counts.clear();
+            stringstream ss(value);
+            string t;
+            while (getline(ss, t, ',')) {
+                options.team_counts.push_back(stoi(t));
+            }
+        } else if (flag == "--games-per-team") {
+            options.games_per_team = stoi(value);
+        } else if (flag == "--structure") {
+            options.round_robin = value == "round-robin";
+        } else if (flag == "--seed") {
+            options.seed = stoull(value);
+        } else if (flag == "--ops") {
+            options.micro_ops = stoi(value);
+        } else if (flag == "--iters") {
+            options.anneal_iters = stoi(value);
+        } else if (flag == "--temperature") {
+            options.temperature = stof(value);
+        } else if (flag == "--target") {
+            options.target_fraction = stof(value);
+        } else if (flag == "--format") {
+            options.csv = value == "csv";
+        } else {
+            cerr << "Unknown option " << flag << endl;
+            exit(1);
+        }
+    }
+    return options;
+}
+
 
-int main() {
+int main(int argc, char* argv[]) {
     string schedule_str = "TB,NO;CHI,PIT;KC,NYJ;PIT,GB;DAL,NYJ;CAR,DAL;HOU,OAK;PIT,BAL;CLE,IND;MIN,BUF;IND,BAL;BAL,CIN;TB,DET;HOU,IND;NYJ,BUF;SF,SEA;PHI,WAS;MIA,TEN;CLE,CIN;WAS,CHI;DEN,CIN;NYG,CHI;CHI,DET;BAL,STL;MIN,SF;TB,ATL;NO,BAL;IND,OAK;WAS,PHI;NYG,PHI;WAS,DAL;NYG,DEN;ARI,MIN;GB,CLE;PHI,TEN;CIN,BUF;WAS,NYG;TB,BUF;CLE,KC;STL,ARI;KC,SF;CAR,NYG;DEN,NE;MIN,NO;OAK,JAX;SF,ATL;CLE,PHI;TB,PHI;NYG,WAS;SD,DEN;TB,CLE;SEA,SF;CIN,OAK;CHI,CIN;IND,HOU;NYG,DAL;NYJ,ARI;JAX,SD;TEN,DAL;BUF,ATL;PHI,CIN;ATL,STL;ATL,CHI;SEA,NO;SEA,ARI;TEN,CIN;CIN,CLE;CIN,IND;CIN,NYG;KC,SD;SF,PIT;OAK,SD;ARI,KC;CAR,ATL;CAR,NO;OAK,GB;STL,MIA;ARI,HOU;CAR,WAS;KC,DEN;CAR,MIA;CIN,BAL;NO,ATL;GB,DET;SF,BAL;SF,WAS;JAX,DEN;CIN,PIT;JAX,DET;JAX,SF;GB,TEN;GB,ATL;TEN,KC;ATL,SD;MIA,KC;HOU,JAX;WAS,GB;HOU,NE;SD,OAK;STL,NE;TEN,STL;OAK,KC;KC,OAK;NE,SEA;CLE,PIT;PIT,MIN;BAL,NYJ;CHI,STL;MIN,TB;NYG,JAX;WAS,TB;NYG,DET;CHI,SEA;BAL,CLE;SD,KC;CAR,TB;GB,MIN;DEN,OAK;ARI,NYG;DAL,WAS;NE,BUF;SD,BAL;SF,STL;CIN,CAR;STL,SF;NYJ,SD;HOU,TEN;MIN,DET;NO,PHI;SF,NYG;NYJ,MIA;SF,ARI;DET,SEA;ARI,SEA;DAL,NO;NE,DAL;SD,TEN;MIA,CHI;STL,TB;SEA,HOU;BUF,BAL;NE,CLE;GB,CHI;BUF,JAX;CLE,NO;TB,CAR;SEA,STL;IND,TB;NE,MIA;DEN,PHI;WAS,OAK;SD,NYG;STL,SEA;BUF,MIA;HOU,MIA;DET,IND;PIT,CLE;NO,SF;STL,CAR;PIT,CIN;ARI,SF;JAX,NE;CLE,BAL;BAL,PIT;DET,MIN;BAL,ATL;ATL,NO;PHI,NYG;MIN,NE;DEN,CLE;NE,SD;NYJ,DEN;ARI,DET;MIN,CHI;GB,ARI;PHI,DAL;DAL,NYG;DAL,MIN;BUF,NO;OAK,CAR;SD,WAS;HOU,MIN;SEA,JAX;PIT,IND;DAL,PHI;BUF,NE;DAL,ARI;ATL,NYJ;PHI,CAR;PHI,GB;WAS,IND;NYJ,HOU;OAK,DEN;CLE,TEN;DET,KC;NYJ,NE;JAX,TEN;MIA,NYJ;GB,DAL;NE,PIT;MIN,GB;BAL,MIA;CHI,DAL;ATL,TB;DET,GB;PIT,HOU;NO,OAK;IND,TEN;TEN,IND;NO,GB;CHI,MIN;SD,CIN;CHI,GB;ATL,CAR;SEA,ATL;DAL,DEN;IND,JAX;ARI,STL;NYG,SEA;PHI,STL;ATL,WAS;OAK,NYJ;MIA,DET;SEA,PHI;NYJ,WAS;TEN,HOU;TEN,JAX;TB,ARI;MIA,BUF;IND,ARI;KC,HOU;MIA,DEN;NO,CAR;NO,TB;BUF,NYJ;KC,PIT;DET,CHI;NE,NYJ;JAX,HOU;DET,CAR;TEN,PIT;DEN,SEA;HOU,CHI;DEN,SD;BAL,JAX;MIA,NE;OAK,BUF;STL,MIN;IND,BUF;DET,SF;CAR,SD;BUF,CLE;JAX,IND;PIT,MIA;DEN,KC;KC,TB";
     //string schedule_str = "C,D;B,C;A,C;A,D;B,D;A,B";
-    vector<vector<string>> schedule = parse_schedule(schedule_str);
-    ScheduleAnnealer annealer = ScheduleAnnealer(schedule, 32);
-    annealer.anneal();
+    Schedule schedule = parse_schedule(schedule_str);
+    if (argc > 3 && string(argv[1]) == "convert") {
+        // Convert a schedule between the text, CSV and binary formats ("convert IN OUT [--csv-header]").
+        try {
+            save_schedule(argv[3], load_schedule(argv[2], argc > 4 && string(argv[4]) == "--csv-header"));
+        } catch (const exception& e) {
+            cerr << e.what() << endl;
+            return 1;
+        }
+        return 0;
+    }
+    if (argc > 2 && string(argv[1]) == "batch") {
+        // Optimise every schedule listed in the manifest (optionally with the given number of threads).
+        int num_threads = argc > 3 ? stoi(argv[3]) : max(1u, thread::hardware_concurrency());
+        run_batch(argv[2], num_threads);
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "bench") {
+        // Run the benchmarks on synthetic leagues instead of optimising the schedule.
+        ScheduleBenchmark benchmark = ScheduleBenchmark(parse_bench_options(argc, argv));
+        benchmark.run();
+    } else if (argc > 1 && string(argv[1]) == "tempering") {
+        // Run parallel tempering instead of a single annealing chain (optionally with the given number of 
+        // replicas).
+        TemperingConfig config;
+        if (argc > 2) {
+            config.num_replicas = stoi(argv[2]);
+        }
+        ParallelTempering tempering = ParallelTempering(schedule, 32, config);
+        tempering.run();
+    } else if (argc > 1 && (string(argv[1]) == "islands" || string(argv[1]) == "island")) {
+        // "islands [count] [input] [output]" runs the island model with the given number of island processes. 
+        // "island BOARD INDEX COUNT [input] [output]" runs one island of COUNT that migrate through the named 
+        // shared memory board, for starting the islands separately (they must all load the same schedule).
+        bool single = string(argv[1]) == "island";
+        int first_arg = single ? 5 : 3;
+        if (single && argc < first_arg) {
+            cerr << "Usage: island BOARD INDEX COUNT [input] [output]" << endl;
+            return 1;
+        }
+        IslandConfig config;
+        if (argc > first_arg - 1) {
+            config.num_islands = stoi(argv[first_arg - 1]);
+        }
+        if (config.num_islands < 1) {
+            cerr << "The number of islands must be at least 1" << endl;
+            return 1;
+        }
+        if (single && (stoi(argv[3]) < 0 || stoi(argv[3]) >= config.num_islands)) {
+            cerr << "Usage: island BOARD INDEX COUNT [input] [output] (with 0 <= INDEX < COUNT)" << endl;
+            return 1;
+        }
+        try {
+            if (argc > first_arg) {
+                schedule = load_schedule(argv[first_arg]);
+            }
+            if (single) {
+                IslandBoard board(argv[2], config.num_islands, schedule.size(), schedule_fingerprint(schedule));
+                Island island(schedule, schedule.num_teams(), config, stoi(argv[3]), board);
+                island.run();
+                cout << "Best Cost: " << island.get_annealer().get_best_cost() << ", Adopted Schedules = " 
+                     << island.get_num_adopted() << endl;
+            } else {
+                schedule = run_islands(schedule, schedule.num_teams(), config);
+            }
+        } catch (const exception& e) {
+            cerr << e.what() << endl;
+            return 1;
+        }
+        if (argc > first_arg + 1) {
+            save_schedule(argv[first_arg + 1], schedule);
+        }
+    } else {
+        // Options: "--trace trace.csv|trace.json" writes the cost/temperature trace, "--budget 2" anneals within a 
+        // wall-clock budget (in seconds), "--adaptive" uses the adaptive cooling schedule, and "--stall 3" stops 
+        // after three temperatures without improvement. "--input path" anneals the schedule in the given file 
+        // (in any format load_schedule understands, with "--csv-header" if a CSV file starts with a header line) and 
+        // "--output path" saves the optimised schedule.  
+        // "--checkpoint path" periodically saves the annealer's state (every "--checkpoint-every n" iterations) and 
+        // "--resume path" continues from a saved state. The hard constraints are set with "--rest k" (no team plays 
+        // within k slots of its previous game), "--round-length n" (no team plays twice in a round of n slots) and 
+        // "--blackout TEAM:slot" (the team can't play in the slot, may be repeated). Moves never add violations but 
+        // may fail to remove all of those in the starting schedule: the result is still saved, but the program 
+        // warns and exits with status 2 if it breaks any hard constraint. Extra cost terms are added with 
+        // "--home-away w" (breaks in home/away alternation, weighted by w), "--travel path" (distances between 
+        // venues, weighted by "--travel-weight w") and "--rematch n" (rematches closer than n slots), and 
+        // "--verify-costs" checks the tracked costs against a full recomputation throughout the run. "--multi-try k" 
+        // adds multiple-try swaps that choose among k candidates, "--swaps-only" disables the insertion and reversal 
+        // moves, and "--no-delta-cache" turns off the swap delta cache (which is only used when swaps are the only 
+        // moves). Edits to the  
+        // schedule ("--insert TEAM1,TEAM2:slot", "--remove slot" and "--pin slot", applied in order) switch to the 
+        // edit mode: the full anneal is skipped, and only the slots around every inserted or removed game are 
+        // re-optimised (reporting how many of them moved).
+        AnnealerConfig config;
+        string trace_path;
+        string travel_path;
+        float travel_weight = 1.0;
+        string resume_path;
+        string input_path;
+        bool csv_header = false;
+        string output_path;
+        vector<string> blackouts;
+        vector<pair<string, string>> edits;
+        int num_teams = 32;
+        for (int i = 1; i < argc; i++) {
+            string flag = argv[i];
+            if (flag == "--input" && i + 1 < argc) {
+                input_path = argv[++i];
+            } else if (flag == "--csv-header") {
+                csv_header = true;
+            } else if (flag == "--output" && i + 1 < argc) {
+                output_path = argv[++i];
+            } else if (flag == "--checkpoint" && i + 1 < argc) {
+                config.checkpoint_path = argv[++i];
+            } else if (flag == "--checkpoint-every" && i + 1 < argc) {
+                config.checkpoint_every = stol(argv[++i]);
+            } else if (flag == "--resume" && i + 1 < argc) {
+                resume_path = argv[++i];
+            } else if (flag == "--trace" && i + 1 < argc) {
+                trace_path = argv[++i];
+            } else if (flag == "--budget" && i + 1 < argc) {
+                config.cooling = Cooling::TimeBudget;
+                config.time_budget_seconds = stod(argv[++i]);
+            } else if (flag == "--adaptive") {
+                config.cooling = Cooling::Adaptive;
+            } else if (flag == "--stall" && i + 1 < argc) {
+                config.stall_temperatures = stoi(argv[++i]);
+            } else if (flag == "--rest" && i + 1 < argc) {
+                config.rest_slots = stoi(argv[++i]);
+            } else if (flag == "--round-length" && i + 1 < argc) {
+                config.round_length = stoi(argv[++i]);
+            } else if (flag == "--blackout" && i + 1 < argc) {
+                blackouts.push_back(argv[++i]);
+            } else if (flag == "--home-away" && i + 1 < argc) {
+                config.cost_terms.push_back(make_shared<HomeAwayTerm>(stof(argv[++i])));
+            } else if (flag == "--travel" && i + 1 < argc) {
+                travel_path = argv[++i];
+            } else if (flag == "--travel-weight" && i + 1 < argc) {
+                travel_weight = stof(argv[++i]);
+            } else if (flag == "--rematch" && i + 1 < argc) {
+                config.cost_terms.push_back(make_shared<RematchTerm>(1.0, stoi(argv[++i])));
+            } else if (flag == "--verify-costs") {
+                config.verify_costs = true;
+            } else if (flag == "--no-delta-cache") {
+                config.cache_swap_deltas = false;
+            } else if (flag == "--swaps-only") {
+                config.insertion_weight = 0.0;
+                config.reversal_weight = 0.0;
+            } else if (flag == "--multi-try" && i + 1 < argc) {
+                config.multi_try_weight = 1.0;
+                config.multi_try_candidates = stoi(argv[++i]);
+            } else if ((flag == "--insert" || flag == "--remove" || flag == "--pin") && i + 1 < argc) {
+                edits.push_back({flag, argv[++i]});
+            } else {
+                cerr << "Unknown option " << flag << endl;
+                return 1;
+            }
+        }
+        // The input is loaded once every option has been read, as "--csv-header" may follow "--input".
+        if (!input_path.empty()) {
+            try {
+                schedule = load_schedule(input_path, csv_header);
+            } catch (const exception& e) {
+                cerr << e.what() << endl;
+                return 1;
+            }
+            num_teams = schedule.num_teams();
+        }
+        // Blackouts name their teams, so they are resolved once the schedule is known.
+        for (const string& blackout : blackouts) {
+            size_t split_loc = blackout.rfind(':');
+            optional<TeamId> team = 
+                split_loc == string::npos ? nullopt : schedule.find_team(blackout.substr(0, split_loc));
+            int idx = team ? stoi(blackout.substr(split_loc + 1)) : -1;
+            if (!team || idx < 0 || idx >= schedule.size()) {
+                cerr << "Invalid blackout " << blackout << endl;
+                return 1;
+            }
+            config.blackouts.push_back({*team, idx});
+        }
+        if (!travel_path.empty()) {
+            try {
+                config.cost_terms.push_back(load_travel_term(travel_path, schedule, travel_weight));
+            } catch (const exception& e) {
+                cerr << e.what() << endl;
+                return 1;
+            }
+        }
+        ScheduleAnnealer annealer = ScheduleAnnealer(schedule, num_teams, config);
+        if (!resume_path.empty()) {
+            try {
+                annealer.load_checkpoint(resume_path);
+            } catch (const exception& e) {
+                cerr << e.what() << endl;
+                return 1;
+            }
+        }
+        if (edits.empty()) {
+            annealer.anneal();
+        } else {
+            cout << "Applying " << edits.size() << " edits with local re-optimisation (the full anneal is skipped)" 
+                 << endl;
+        }
+        for (const auto& [flag, value] : edits) {
+            int idx;
+            try {
+                if (flag == "--pin") {
+                    annealer.pin_game(stoi(value));
+                    continue;
+                } else if (flag == "--remove") {
+                    idx = stoi(value);
+                    annealer.remove_game(idx);
+                } else {
+                    size_t team_split = value.find(',');
+                    size_t slot_split = value.rfind(':');
+                    optional<TeamId> team1 = schedule.find_team(value.substr(0, team_split));
+                    optional<TeamId> team2 = team_split == string::npos || slot_split == string::npos ? nullopt 
+                        : schedule.find_team(value.substr(team_split + 1, slot_split - team_split - 1));
+                    if (!team1 || !team2) {
+                        throw invalid_argument("Invalid game " + value);
+                    }
+                    idx = stoi(value.substr(slot_split + 1));
+                    annealer.insert_game(*team1, *team2, idx);
+                }
+            } catch (const exception& e) {
+                cerr << e.what() << endl;
+                return 1;
+            }
+            // Report how much of the edited schedule the local re-optimisation changed (only games in the window 
+            // can move).
+            Schedule edited = schedule;
+            auto [lo, hi] = annealer.local_window(idx);
+            auto start = chrono::steady_clock::now();
+            float cost_change = annealer.reoptimize_around(idx);
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            int num_moved = 0;
+            for (int i = lo; i <= hi; i++) {
+                num_moved += schedule.teams[0][i] != edited.teams[0][i] || schedule.teams[1][i] != edited.teams[1][i];
+            }
+            cout << "Edit " << flag.substr(2) << " " << value << ": Cost = " << annealer.get_cost() 
+                 << ", Re-optimisation Change = " << cost_change << ", Games Moved = " << num_moved << "/" 
+                 << hi - lo + 1 << " in slots " << lo << "-" << hi << " (" << schedule.size() << " games), Time = " 
+                 << seconds << "s" << endl;
+        }
+        if (!output_path.empty()) {
+            save_schedule(output_path, schedule);
+        }
+        if (!trace_path.empty()) {
+            string path = trace_path;
+            ofstream out(path);
+            if (path.ends_with(".json")) {
+                annealer.get_metrics().write_json(out);
+            } else {
+                annealer.get_metrics().write_csv(out);
+            }
+        }
+        if (int violations = annealer.count_violations(); violations > 0) {
+            cerr << "Warning: the final schedule is infeasible (" << violations << " hard constraint violations)" 
+                 << endl;
+            return 2;
+        }
+    }
 
     return 0;
 }
\ No newline at end of file